@@ -16,14 +16,30 @@
 /*                                                                   */
 /* Enable the field line display by pressing 'f'.                    */
 /* Enable a field line grid by pressing 'l'.                         */
+/* Cycle the shape dragged out of the menu by pressing 's'.          */
+/* Besides point charges you get uniformly charged segments,         */
+/* polylines and rings, whose fields are computed in closed form.    */
+/* Drag a vertex of a segment or polyline to reshape it, or the wire */
+/* of a ring to resize it.                                           */
 /*                                                                   */
 /*********************************************************************/
 #include <GLUT/glut.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <vector>
+#include <complex>
+#include <map>
+#include <algorithm>
 #include <iostream>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "scenestream.h"
 using namespace std;
 
 #define CHAI3D 1
@@ -54,19 +70,60 @@ class CPointCharge;
 #define VIEWPORT_W 800
 #define VIEWPORT_H 600
 #define CHARGE_RAD 10
+#define SOFTEN_RR 225.0       // Probes never get closer than 15 units
+#define LINE_SPACING 20.0     // Line charge == point charges this far apart
+#define RING_MIN_RADIUS 20.0  // Smallest ring, see CRingCharge::NearWire()
+
+// The charge shapes (SHAPE_*) are part of the stream format, and live 
+//    in scenestream.h
+
+// Multi-rate haptics
+#define HAPTIC_RATE 4000          // Haptic ticks per second
+#define FIELD_RATE 300            // Field linearizations per second
+#define JACOBIAN_STEP 0.5         // Finite difference step, in pixels
+#define MAX_DAMPING 0.01          // Passivity controller damping limit
+#define MAX_ENERGY_CREDIT 5.0     // Dissipated energy we may give back
+
+// Periodic mode (Ewald summation with a particle mesh)
+#define EWALD_TOL 1e-5            // Real-space truncation error
+#define EWALD_MAX_MESH 512        // Largest mesh, per side
+#define IMAGE_SHELLS 100          // Image shells for the brute-force check
+#define SAMPLE_SPACING 3.75       // Lines and rings become point charges
+                                  //    a quarter softening radius apart
 
 bool showFieldVector;
 bool showFieldLines;
 bool enableHaptics;
 bool enableDragging;
+int chargeShape;
+bool periodicMode;
+float ewaldCutoff = 100;      // Real-space cutoff, in pixels
+int ewaldMesh = 64;           // Mesh points per side, a power of two
 
 void Dragging(int x, int y);
 CPointCharge *selectedCharge;
+int selectedHandle = -1;         // Handle being dragged, or -1 for all of it
 
 std::vector<CPointCharge*> m_simcharges;     // Sim. point charges
 std::vector<CPointCharge*> m_menucharges;    // Menu point charges
 std::vector<cVector3d*> m_fieldlines;        // Field line clicks
 
+// Guards m_simcharges against the haptic thread.  Bumping sceneVersion
+//    tells anything that caches field data that the scene has changed.
+pthread_mutex_t sceneMutex = PTHREAD_MUTEX_INITIALIZER;
+volatile unsigned int sceneVersion;
+
+/** Scene streaming **************************************************/
+int streamFd = -1;                           // stdin or listening socket
+bool streamIsSocket;
+pthread_t streamThread;
+pthread_mutex_t streamMutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<StreamRecord> m_streampending;   // Records since last frame
+std::map<uint32_t, CPointCharge*> m_streamcharges;  // Streamed, by id
+long streamReceived, streamApplied;          // Records since last report
+long streamRejected;
+double streamReportTime;
+
 /** CHAI3d Stuff *****************************************************/
 #ifdef CHAI3D
 cWorld* world;
@@ -82,8 +139,8 @@ cVector3d fieldPos;
 cPrecisionClock g_clock;
 double timeCounter;
 
-// Haptic timer callback
-cPrecisionTimer timer;
+// Haptic thread, ticking hapticsLoop() at HAPTIC_RATE
+pthread_t hapticThread;
 #endif
 /*********************************************************************/
 
@@ -94,11 +151,16 @@ public:
    CPointCharge(int x, int y, int charge);
    virtual ~CPointCharge();
    
-   void Draw();   
+   virtual void Draw();   
    void DrawChar(int x, int y, int c);
    
    bool Clicked(float x, float y);
-   float Distance(float x, float y);
+   virtual float Distance(float x, float y);
+   virtual cVector3d Field(float x, float y);
+   virtual double Potential(float x, float y);
+   virtual void Sample(std::vector<cVector3d>& pts, std::vector<double>& q);
+   virtual int Handle(float x, float y);
+   virtual void MoveHandle(int handle, float x, float y);
    
    int m_x, m_y;   
    cVector3d pos;
@@ -198,6 +260,629 @@ float CPointCharge::Distance(float x, float y)
    return sqrt(pow(dx,2)+pow(dy,2));
 }
 
+/*********************************************************************/
+/* Get the (unscaled) E-field of this charge at the passed point.    */
+/*********************************************************************/
+cVector3d CPointCharge::Field(float x, float y)
+{
+   // Get the distance vector
+   cVector3d r = cVector3d(x, y, 0) - pos;
+   
+   // Find inverse of r^2
+   float rr = r.lengthsq();
+   if (rr <= SOFTEN_RR) rr = SOFTEN_RR;
+   float irr = 1/rr;
+   float sirr = m_charge * irr;
+   r.normalize();
+   
+   // Convert scalar back into vector
+   return r * sirr;
+}
+
+/*********************************************************************/
+/* Get the (unscaled) potential of this charge at the passed point.  */
+/*    Inside the softening radius the field has constant magnitude,  */
+/*    so the potential keeps falling off linearly there.             */
+/*********************************************************************/
+double CPointCharge::Potential(float x, float y)
+{
+   double soft = sqrt(SOFTEN_RR);
+   double r = Distance(x, y);
+   
+   if (r < soft) return m_charge * (1/soft + (soft - r) / SOFTEN_RR);
+   return m_charge / r;
+}
+
+/*********************************************************************/
+/* Break the charge into point charges, for the periodic solver.     */
+/*********************************************************************/
+void CPointCharge::Sample(std::vector<cVector3d>& pts, std::vector<double>& q)
+{
+   pts.push_back(pos);
+   q.push_back(m_charge);
+}
+
+/*********************************************************************/
+/* Shaped charges have handles that can be dragged to resize them.   */
+/*    Return the handle at the passed point, or -1 if there is none. */
+/*********************************************************************/
+int CPointCharge::Handle(float x, float y)
+{
+   return -1;
+}
+
+/*********************************************************************/
+/* Drag the given handle to the passed point.                        */
+/*********************************************************************/
+void CPointCharge::MoveHandle(int handle, float x, float y)
+{
+}
+
+/*********************************************************************/
+/* A polyline with uniform linear charge density.  A plain segment   */
+/*    is just a polyline with two vertices.  The charge value is the */
+/*    charge per LINE_SPACING units of length, so one segment stands */
+/*    in for a row of point charges that far apart.                  */
+/*********************************************************************/
+class CLineCharge : public CPointCharge {
+public:
+   
+   CLineCharge(int x, int y, int charge);
+   
+   void AddVertex(float dx, float dy);
+   
+   virtual void Draw();
+   virtual float Distance(float x, float y);
+   virtual cVector3d Field(float x, float y);
+   virtual double Potential(float x, float y);
+   virtual void Sample(std::vector<cVector3d>& pts, std::vector<double>& q);
+   virtual int Handle(float x, float y);
+   virtual void MoveHandle(int handle, float x, float y);
+   
+   std::vector<cVector3d> m_vertices;   // Offsets from (m_x, m_y)
+   float m_density;
+};
+
+/*********************************************************************/
+/* A ring with uniform linear charge density, centred on (m_x, m_y). */
+/*********************************************************************/
+class CRingCharge : public CPointCharge {
+public:
+   
+   CRingCharge(int x, int y, int charge, float ringRadius);
+   
+   virtual void Draw();
+   virtual float Distance(float x, float y);
+   virtual cVector3d Field(float x, float y);
+   virtual double Potential(float x, float y);
+   virtual void Sample(std::vector<cVector3d>& pts, std::vector<double>& q);
+   virtual int Handle(float x, float y);
+   virtual void MoveHandle(int handle, float x, float y);
+   
+   void Radial(double rho, double& field, double& phi);
+   void NearWire(double rho, double& field, double& phi);
+   double RadialField(double rho);
+   double RingPotential(double rho);
+   
+   float m_ringRadius;
+   float m_density;
+};
+
+/*********************************************************************/
+/* Closed-form field and potential of a uniformly charged segment    */
+/*    from a to b.  This is the softened point charge (see           */
+/*    CPointCharge::Potential) integrated along the segment, so it   */
+/*    is exact wherever the probe is 15 units or more from the       */
+/*    segment, and the field is always the gradient of the potential.*/
+/*********************************************************************/
+void SegmentIntegral(const cVector3d& a, const cVector3d& b, float x, float y, 
+                     float density, cVector3d& field, double& phi)
+{
+   field = cVector3d(0.0, 0.0, 0.0);
+   phi = 0.0;
+   
+   cVector3d u = b - a;
+   double len = u.length();
+   if (len <= 0.0) return;
+   u = u / len;
+   cVector3d n(-u.y, u.x, 0.0);
+   
+   // Probe in segment coordinates: s along the segment, d across it
+   cVector3d ap = cVector3d(x, y, 0) - a;
+   double s = ap.dot(u);
+   double d = ap.dot(n);
+   double ad = fabs(d);
+   if (ad < 1e-9) ad = 1e-9;
+   
+   // Segment ends relative to the foot of the perpendicular
+   double t1 = -s, t2 = len - s;
+   
+   // Charge within 15 units of the probe lies in |t| < w
+   double w = -1.0;
+   if (d*d < SOFTEN_RR) w = sqrt(SOFTEN_RR - d*d);
+   
+   // Pieces of the segment: [lo, hi] and whether they are softened
+   double lo[3], hi[3];
+   bool near[3];
+   int pieces = 0;
+   if (w < 0.0)
+   {
+      lo[0] = t1; hi[0] = t2; near[0] = false;
+      pieces = 1;
+   }
+   else
+   {
+      double cuts[4] = { t1, max(t1, min(t2, -w)), max(t1, min(t2, w)), t2 };
+      for (int k = 0; k < 3; k++)
+      {
+         if (cuts[k+1] <= cuts[k]) continue;
+         lo[pieces] = cuts[k]; hi[pieces] = cuts[k+1]; near[pieces] = (k == 1);
+         pieces++;
+      }
+   }
+   
+   double epar = 0.0, eperp = 0.0;
+   for (int k = 0; k < pieces; k++)
+   {
+      double ra = sqrt(lo[k]*lo[k] + d*d), rb = sqrt(hi[k]*hi[k] + d*d);
+      double ash = asinh(hi[k] / ad) - asinh(lo[k] / ad);
+      
+      if (near[k])
+      {
+         // Softened kernel: potential 2/15 - r/225, field r/(225 r)
+         double soft = sqrt(SOFTEN_RR);
+         double g = 0.5 * (hi[k]*rb - lo[k]*ra + d*d*ash);
+         phi += density * (2/soft * (hi[k] - lo[k]) - g / SOFTEN_RR);
+         epar -= density * (rb - ra) / SOFTEN_RR;
+         eperp += density * d * ash / SOFTEN_RR;
+      }
+      else
+      {
+         phi += density * ash;
+         epar += density * (1/rb - 1/ra);
+         if (fabs(d) > 1e-9)
+            eperp += density * (hi[k]/rb - lo[k]/ra) / d;
+      }
+   }
+   
+   field = u * epar + n * eperp;
+}
+
+cVector3d SegmentField(const cVector3d& a, const cVector3d& b, 
+                       float x, float y, float density)
+{
+   cVector3d field;
+   double phi;
+   SegmentIntegral(a, b, x, y, density, field, phi);
+   return field;
+}
+
+double SegmentPotential(const cVector3d& a, const cVector3d& b, 
+                        float x, float y, float density)
+{
+   cVector3d field;
+   double phi;
+   SegmentIntegral(a, b, x, y, density, field, phi);
+   return phi;
+}
+
+/*********************************************************************/
+/* Complete elliptic integrals K(m) and E(m) using the AGM.          */
+/*********************************************************************/
+void EllipticKE(double m, double& K, double& E)
+{
+   double a = 1.0, b = sqrt(1.0 - m), c = sqrt(m);
+   double pow2 = 0.5, sum = 0.5 * m;
+   
+   while (fabs(c) > 1e-12)
+   {
+      double an = (a + b) / 2;
+      c = (a - b) / 2;
+      b = sqrt(a * b);
+      a = an;
+      pow2 *= 2;
+      sum += pow2 * c * c;
+   }
+   
+   K = PI / (2 * a);
+   E = K * (1.0 - sum);
+}
+
+CLineCharge::CLineCharge(int x, int y, int charge)
+   : CPointCharge(x, y, charge)
+{
+   m_density = charge / LINE_SPACING;
+}
+
+void CLineCharge::AddVertex(float dx, float dy)
+{
+   m_vertices.push_back(cVector3d(dx, dy, 0));
+}
+
+/*********************************************************************/
+/* Solid line for positive charges, dashed line for negative ones.   */
+/*********************************************************************/
+void CLineCharge::Draw()
+{
+   glColor3f(1.0f, 0.0f, 0.0f);
+   
+   glPushAttrib(GL_LINE_BIT);
+   glLineWidth(4.0);
+   if (m_charge < 0)
+   {
+      glEnable(GL_LINE_STIPPLE);
+      glLineStipple(2, 0x00FF);
+   }
+   
+   glBegin(GL_LINE_STRIP);
+   for (unsigned int i = 0; i < m_vertices.size(); i++)
+      glVertex2f(m_x + m_vertices[i].x, m_y + m_vertices[i].y);
+   glEnd();
+   glPopAttrib();
+   
+   DrawChar(m_x, m_y, m_charge);
+}
+
+/*********************************************************************/
+/* Distance from the passed point to the nearest segment, or to the  */
+/*    label, so the charge can be picked up by either.               */
+/*********************************************************************/
+float CLineCharge::Distance(float x, float y)
+{
+   float best = CPointCharge::Distance(x, y);
+   cVector3d p(x, y, 0);
+   
+   for (unsigned int i = 1; i < m_vertices.size(); i++)
+   {
+      cVector3d a = pos + m_vertices[i-1];
+      cVector3d ab = (pos + m_vertices[i]) - a;
+      double t = 0.0;
+      if (ab.lengthsq() > 0.0) t = (p - a).dot(ab) / ab.lengthsq();
+      if (t < 0.0) t = 0.0;
+      if (t > 1.0) t = 1.0;
+      float dist = (p - (a + ab * t)).length();
+      if (dist < best) best = dist;
+   }
+   
+   return best;
+}
+
+/*********************************************************************/
+/* Every vertex is a handle.                                         */
+/*********************************************************************/
+int CLineCharge::Handle(float x, float y)
+{
+   for (unsigned int i = 0; i < m_vertices.size(); i++)
+   {
+      cVector3d d = pos + m_vertices[i] - cVector3d(x, y, 0);
+      if (d.length() <= m_radius) return i;
+   }
+   
+   return -1;
+}
+
+void CLineCharge::MoveHandle(int handle, float x, float y)
+{
+   if (handle < 0 || handle >= (int)m_vertices.size()) return;
+   m_vertices[handle] = cVector3d(x, y, 0) - pos;
+}
+
+cVector3d CLineCharge::Field(float x, float y)
+{
+   cVector3d field(0.0, 0.0, 0.0);
+   
+   for (unsigned int i = 1; i < m_vertices.size(); i++)
+      field += SegmentField(pos + m_vertices[i-1], pos + m_vertices[i], 
+                            x, y, m_density);
+   
+   return field;
+}
+
+CRingCharge::CRingCharge(int x, int y, int charge, float ringRadius)
+   : CPointCharge(x, y, charge)
+{
+   m_ringRadius = (ringRadius < RING_MIN_RADIUS) ? RING_MIN_RADIUS : ringRadius;
+   m_density = charge / LINE_SPACING;
+}
+
+void CRingCharge::Draw()
+{
+   glColor3f(1.0f, 0.0f, 0.0f);
+   
+   glPushAttrib(GL_LINE_BIT);
+   glLineWidth(4.0);
+   if (m_charge < 0)
+   {
+      glEnable(GL_LINE_STIPPLE);
+      glLineStipple(2, 0x00FF);
+   }
+   
+   glBegin(GL_LINE_LOOP);
+   for(int j=0; j<360; j = j + 5){
+      float th=PI * j / 180.0;
+      glVertex2f(m_x+m_ringRadius*cos(th), m_y+m_ringRadius*sin(th));
+   }
+   glEnd();
+   glPopAttrib();
+   
+   DrawChar(m_x, m_y, m_charge);
+}
+
+/*********************************************************************/
+/* The ring can be picked up by its wire or by the label in the      */
+/*    middle.  The wire is its one handle, and sets the radius.      */
+/*********************************************************************/
+float CRingCharge::Distance(float x, float y)
+{
+   float d = CPointCharge::Distance(x, y);
+   return min(d, (float)fabs(d - m_ringRadius));
+}
+
+int CRingCharge::Handle(float x, float y)
+{
+   if (fabs(CPointCharge::Distance(x, y) - m_ringRadius) <= m_radius) return 0;
+   return -1;
+}
+
+void CRingCharge::MoveHandle(int handle, float x, float y)
+{
+   if (handle != 0) return;
+   float r = CPointCharge::Distance(x, y);
+   m_ringRadius = (r < RING_MIN_RADIUS) ? RING_MIN_RADIUS : r;
+}
+
+/*********************************************************************/
+/* Closed-form radial field of the ring in its own plane.            */
+/*********************************************************************/
+cVector3d CRingCharge::Field(float x, float y)
+{
+   cVector3d r = cVector3d(x, y, 0) - pos;
+   double rho = r.length();
+   if (rho < 1e-6) return cVector3d(0.0, 0.0, 0.0);
+   
+   double field, phi;
+   Radial(rho, field, phi);
+   return r * (field / rho);
+}
+
+double CLineCharge::Potential(float x, float y)
+{
+   double phi = 0.0;
+   
+   for (unsigned int i = 1; i < m_vertices.size(); i++)
+      phi += SegmentPotential(pos + m_vertices[i-1], pos + m_vertices[i], 
+                              x, y, m_density);
+   
+   return phi;
+}
+
+/*********************************************************************/
+/* Point charges SAMPLE_SPACING apart, or a little closer so that    */
+/*    each segment divides evenly.  Any coarser and the field        */
+/*    ripples along the wire, as the softened kernel has a kink.     */
+/*********************************************************************/
+void CLineCharge::Sample(std::vector<cVector3d>& pts, std::vector<double>& q)
+{
+   for (unsigned int i = 1; i < m_vertices.size(); i++)
+   {
+      cVector3d a = pos + m_vertices[i-1];
+      cVector3d ab = (pos + m_vertices[i]) - a;
+      int n = (int)ceil(ab.length() / SAMPLE_SPACING);
+      
+      for (int k = 0; k < n; k++)
+      {
+         pts.push_back(a + ab * ((k + 0.5) / n));
+         q.push_back(m_density * ab.length() / n);
+      }
+   }
+}
+
+void CRingCharge::Sample(std::vector<cVector3d>& pts, std::vector<double>& q)
+{
+   int n = (int)ceil(2*PI*m_ringRadius / SAMPLE_SPACING);
+   
+   for (int k = 0; k < n; k++)
+   {
+      double th = 2*PI*k / n;
+      pts.push_back(pos + cVector3d(m_ringRadius*cos(th), m_ringRadius*sin(th), 0));
+      q.push_back(m_density * 2*PI*m_ringRadius / n);
+   }
+}
+
+double CRingCharge::Potential(float x, float y)
+{
+   double field, phi;
+   Radial(CPointCharge::Distance(x, y), field, phi);
+   return phi;
+}
+
+/*********************************************************************/
+/* Radial field and potential at distance rho from the centre.       */
+/*    Within 15 units of the wire the bare ring is corrected by the  */
+/*    difference between the softened and the bare point kernel,     */
+/*    integrated over the arc closer than 15 units (see NearWire()). */
+/*********************************************************************/
+void CRingCharge::Radial(double rho, double& field, double& phi)
+{
+   double R = m_ringRadius;
+   
+   if (fabs(rho - R) >= sqrt(SOFTEN_RR))
+   {
+      field = RadialField(rho);
+      phi = RingPotential(rho);
+      return;
+   }
+   
+   // The bare ring diverges on the wire, and the correction with it,
+   //    but their sum is smooth there: interpolate across the wire
+   if (fabs(rho - R) < 1e-3)
+   {
+      double f0, p0, f1, p1, t = (rho - R + 2e-3) / 4e-3;
+      Radial(R - 2e-3, f0, p0);
+      Radial(R + 2e-3, f1, p1);
+      field = f0 + t*(f1 - f0);
+      phi = p0 + t*(p1 - p0);
+      return;
+   }
+   
+   double dfield, dphi;
+   NearWire(rho, dfield, dphi);
+   field = RadialField(rho) + dfield;
+   phi = RingPotential(rho) + dphi;
+}
+
+/*********************************************************************/
+/* Softened minus bare kernel, integrated over the arc within 15     */
+/*    units of a probe at rho.  With theta the angle from the probe  */
+/*    and t = 2 sqrt(R rho) sin(theta/2) the distance to the wire is */
+/*    sqrt((rho-R)^2 + t^2), the singular parts integrate in closed  */
+/*    form and the rest is bounded.  Gauss-Legendre on panels that   */
+/*    double in length away from the probe handles the rest.         */
+/*********************************************************************/
+void CRingCharge::NearWire(double rho, double& field, double& phi)
+{
+   static const double gx[4] = { 0.1834346424956498, 0.5255324099163290, 
+                                 0.7966664774136267, 0.9602898564975363 };
+   static const double gw[4] = { 0.3626837833783620, 0.3137066458778873, 
+                                 0.2223810344533745, 0.1012285362903763 };
+   double R = m_ringRadius, soft = sqrt(SOFTEN_RR);
+   double delta = rho - R, a = fabs(delta);
+   double rr = sqrt(R*rho);
+   double tEnd = sqrt(SOFTEN_RR - a*a);     // Where the wire is 15 away
+   
+   double sumPhi = 0.0, sumField = 0.0;
+   for (double lo = 0.0, hi = min(a, tEnd); lo < tEnd; lo = hi, hi = min(2*hi, tEnd))
+   {
+      double mid = (lo + hi) / 2, half = (hi - lo) / 2;
+      for (int k = 0; k < 8; k++)
+      {
+         double t = mid + half * ((k < 4) ? gx[k] : -gx[k-4]);
+         double wt = half * gw[k % 4];
+         double d = sqrt(a*a + t*t);
+         double w = sqrt(R*rho - t*t/4);         // sqrt(R rho) cos(theta/2)
+         double g = t*t/4 / (w*rr*(rr + w));     // 1/w - 1/sqrt(R rho)
+         double n = delta + t*t/(2*rho);         // rho - R cos(theta)
+         
+         sumPhi += wt * ((2/soft - d/SOFTEN_RR)/w - g/d);
+         sumField += wt * (n/(SOFTEN_RR*d*w) - n*g/(d*d*d));
+      }
+   }
+   
+   // Closed-form parts of the bare kernel, 1/d and n/d^3 over sqrt(R rho)
+   double ash = asinh(tEnd / a);
+   sumPhi -= ash / rr;
+   sumField -= (delta*tEnd/(a*a*soft) + (ash - tEnd/soft)/(2*rho)) / rr;
+   
+   // Both halves of the arc
+   phi = 2*m_density*R * sumPhi;
+   field = 2*m_density*R * sumField;
+}
+
+/*********************************************************************/
+/* Exact in-plane radial field and potential at distance rho from    */
+/*    the centre, in terms of complete elliptic integrals.           */
+/*********************************************************************/
+double CRingCharge::RadialField(double rho)
+{
+   double R = m_ringRadius;
+   if (rho <= 0.0) return 0.0;
+   
+   double K, E;
+   EllipticKE(4*R*rho / ((R + rho)*(R + rho)), K, E);
+   
+   return 2*m_density*R / (rho*(R + rho)) * 
+          (K - (R + rho) / (R - rho) * E);
+}
+
+double CRingCharge::RingPotential(double rho)
+{
+   double R = m_ringRadius;
+   if (rho < 0.0) rho = 0.0;
+   
+   double K, E;
+   EllipticKE(4*R*rho / ((R + rho)*(R + rho)), K, E);
+   
+   return 4*m_density*R*K / (R + rho);
+}
+
+/*********************************************************************/
+/* Compare a ring with a dense ring of softened point charges across */
+/*    the softening band and away from it.  Invoked with -ringcheck. */
+/*********************************************************************/
+int RunRingCheck()
+{
+   const int samples = 200000;
+   CRingCharge ring(400, 325, 3, 60);
+   double R = ring.m_ringRadius, soft = sqrt(SOFTEN_RR);
+   double errField = 0, errPhi = 0, maxField = 0, maxPhi = 0;
+   
+   printf("Ring check: R %.0f, charge %d, %d point charges\n", 
+          R, ring.m_charge, samples);
+   printf("     rho   field     brute     potential brute\n");
+   for (double rho = R - 30; rho <= R + 30.01; rho += 2.5)
+   {
+      // Off the axes, so no probe sits on a sample point
+      cVector3d p = ring.pos + cVector3d(rho*cos(0.3), rho*sin(0.3), 0);
+      cVector3d field(0.0, 0.0, 0.0);
+      double phi = 0.0;
+      for (int k = 0; k < samples; k++)
+      {
+         double th = 2*PI*(k + 0.5) / samples;
+         double q = ring.m_density * 2*PI*R / samples;
+         cVector3d r = p - (ring.pos + cVector3d(R*cos(th), R*sin(th), 0));
+         double d = r.length();
+         field += r * (q / (max(d*d, SOFTEN_RR) * d));
+         phi += q * ((d < soft) ? 1/soft + (soft - d) / SOFTEN_RR : 1/d);
+      }
+      
+      cVector3d f = ring.Field(p.x, p.y);
+      double u = ring.Potential(p.x, p.y);
+      double radial = field.dot(p - ring.pos) / rho;
+      printf("  %6.1f  %8.5f  %8.5f  %8.5f  %8.5f\n", rho, 
+             f.dot(p - ring.pos) / rho, radial, u, phi);
+      
+      errField = max(errField, (f - field).length());
+      errPhi = max(errPhi, fabs(u - phi));
+      maxField = max(maxField, field.length());
+      maxPhi = max(maxPhi, fabs(phi));
+   }
+   
+   bool ok = errField < 1e-4 * maxField && errPhi < 1e-4 * maxPhi;
+   printf("  %s: max error field %.2e, potential %.2e (relative to max)\n", 
+          ok ? "PASS" : "FAIL", errField / maxField, errPhi / maxPhi);
+   return ok ? 0 : 1;
+}
+
+/*********************************************************************/
+/* Create a new sim charge of the currently selected shape.          */
+/*********************************************************************/
+CPointCharge* NewCharge(int shape, int x, int y, int charge)
+{
+   switch (shape)
+   {
+      case SHAPE_SEGMENT:
+      {
+         CLineCharge *l = new CLineCharge(x, y, charge);
+         l->AddVertex(-100, 0);
+         l->AddVertex(100, 0);
+         return l;
+      }
+      case SHAPE_POLYLINE:
+      {
+         CLineCharge *l = new CLineCharge(x, y, charge);
+         l->AddVertex(-100, -40);
+         l->AddVertex(-35, 40);
+         l->AddVertex(35, 40);
+         l->AddVertex(100, -40);
+         return l;
+      }
+      case SHAPE_RING:
+         return new CRingCharge(x, y, charge, 60);
+   }
+   
+   return new CPointCharge(x, y, charge);
+}
+
 /*********************************************************************/
 /* Has the user clicked on a point in the point charge window?       */
 /*********************************************************************/
@@ -227,83 +912,1022 @@ CPointCharge* CheckSimClick(float x, float y)
       CPointCharge* c = (*i1);
       bool clicked = c->Clicked(x, y);
       
-      if (clicked == true)
-         return c;
+      if (clicked == true)
+         return c;
+   }
+   
+   return NULL;
+}
+
+/*********************************************************************/
+/* Iterate through all the charges, and draw them to the screen.     */
+/*********************************************************************/
+void DrawSimCharges()
+{
+   std::vector<CPointCharge*>::iterator i1;
+   for (i1 = m_simcharges.begin(); i1 != m_simcharges.end(); i1++)
+   {
+      CPointCharge* c = (*i1);
+      c->Draw();
+   }
+}
+
+/*********************************************************************/
+/* Iterate through all the charges, and draw them to the screen      */
+/*********************************************************************/
+void DrawMenuCharges()
+{
+   std::vector<CPointCharge*>::iterator i1;
+   for (i1 = m_menucharges.begin(); i1 != m_menucharges.end(); i1++)
+   {
+      CPointCharge* c = (*i1);
+      c->Draw();
+   }
+}
+
+/*********************************************************************/
+/* Wall clock time in seconds, for the self-checks.                  */
+/*********************************************************************/
+double SimNow()
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*********************************************************************/
+/* In-place radix-2 FFT of n complex values spaced 'stride' apart.   */
+/*********************************************************************/
+void FFT(std::complex<double>* a, int n, int stride, bool inverse)
+{
+   // Bit-reversal permutation
+   for (int i = 1, j = 0; i < n; i++)
+   {
+      int bit = n >> 1;
+      for (; j & bit; bit >>= 1) j ^= bit;
+      j ^= bit;
+      if (i < j) std::swap(a[i*stride], a[j*stride]);
+   }
+   
+   for (int len = 2; len <= n; len <<= 1)
+   {
+      double ang = 2*PI / len * (inverse ? 1 : -1);
+      std::complex<double> wl(cos(ang), sin(ang));
+      
+      for (int i = 0; i < n; i += len)
+      {
+         std::complex<double> w(1.0, 0.0);
+         for (int k = 0; k < len/2; k++)
+         {
+            std::complex<double> u = a[(i+k)*stride];
+            std::complex<double> v = a[(i+k+len/2)*stride] * w;
+            a[(i+k)*stride] = u + v;
+            a[(i+k+len/2)*stride] = u - v;
+            w *= wl;
+         }
+      }
+   }
+}
+
+/*********************************************************************/
+/* Field of the sim charges repeated periodically over the window,   */
+/*    by Ewald summation.  The short-range part is summed directly   */
+/*    over neighbours within the cutoff, using a cell list.  The     */
+/*    long-range part is solved once per scene on a mesh with FFTs   */
+/*    (smooth particle mesh Ewald) and interpolated to each probe.   */
+/*    Line and ring charges are broken into point charges first.     */
+/*********************************************************************/
+class CEwaldSolver {
+public:
+   
+   CEwaldSolver();
+   
+   void Limits(float& cutoff, int& mesh);
+   void Build(float cutoff, int mesh);
+   cVector3d Field(float x, float y);
+   double Potential(float x, float y);
+   cVector3d BruteField(float x, float y, int shells);
+   
+   bool m_built;
+   unsigned int m_version;         // sceneVersion at the last Build()
+   double m_cutoff;                // Real-space cutoff
+   double m_alpha;                 // Ewald splitting parameter
+   int m_mesh;                     // Mesh points per side
+   double m_lx, m_ly;              // Periodic cell
+   std::vector<cVector3d> m_pos;   // Point charges, wrapped into the cell
+   std::vector<double> m_q;
+   
+private:
+   
+   void Wrap(double& x, double& y);
+   void Spline(double u, int& first, double w[4], double dw[4]);
+   void RealSpace(double x, double y, cVector3d& field, double& phi);
+   void Mesh(double x, double y, cVector3d& field, double& phi);
+   
+   int m_cellsX, m_cellsY;
+   std::vector<int> m_cellHead;    // First charge in each cell
+   std::vector<int> m_cellNext;    // Next charge in the same cell
+   std::vector<double> m_phi;      // Long-range potential on the mesh
+};
+
+CEwaldSolver::CEwaldSolver()
+{
+   m_built = false;
+   m_version = 0;
+   m_cutoff = m_alpha = 0.0;
+   m_mesh = 0;
+   m_lx = VIEWPORT_W;
+   m_ly = VIEWPORT_H - MENU_H;
+   m_cellsX = m_cellsY = 0;
+}
+
+/*********************************************************************/
+/* Wrap a point into the periodic cell, i.e. the simulation window.  */
+/*********************************************************************/
+void CEwaldSolver::Wrap(double& x, double& y)
+{
+   x -= m_lx * floor(x / m_lx);
+   y -= MENU_H;
+   y -= m_ly * floor(y / m_ly);
+   y += MENU_H;
+}
+
+/*********************************************************************/
+/* Order 4 cardinal B-spline weights (and their derivatives) for a   */
+/*    point at mesh coordinate u.  w[i] belongs to mesh point        */
+/*    first - i.                                                     */
+/*********************************************************************/
+void CEwaldSolver::Spline(double u, int& first, double w[4], double dw[4])
+{
+   first = (int)floor(u);
+   double t = u - first;
+   
+   w[0] = t*t*t / 6;
+   w[1] = (-3*t*t*t + 3*t*t + 3*t + 1) / 6;
+   w[2] = (3*t*t*t - 6*t*t + 4) / 6;
+   w[3] = (1-t)*(1-t)*(1-t) / 6;
+   
+   dw[0] = t*t / 2;
+   dw[1] = (-3*t*t + 2*t + 1) / 2;
+   dw[2] = (3*t*t - 4*t) / 2;
+   dw[3] = -(1-t)*(1-t) / 2;
+}
+
+/*********************************************************************/
+/* Bring the settings into the range Build() can use.  The cutoff    */
+/*    stays outside the softening radius, and short enough that only */
+/*    the nearest image of a charge can be inside it.  The mesh is a */
+/*    power of two for the FFT.                                      */
+/*********************************************************************/
+void CEwaldSolver::Limits(float& cutoff, int& mesh)
+{
+   if (!(cutoff >= 2*sqrt(SOFTEN_RR))) cutoff = 2*sqrt(SOFTEN_RR);
+   if (cutoff > min(m_lx, m_ly) / 2) cutoff = min(m_lx, m_ly) / 2;
+   
+   int m = 8;
+   while (m < mesh && m < EWALD_MAX_MESH) m <<= 1;
+   mesh = m;
+}
+
+/*********************************************************************/
+/* Gather the sim charges and solve the long-range part on the mesh. */
+/*********************************************************************/
+void CEwaldSolver::Build(float cutoff, int mesh)
+{
+   m_pos.clear();
+   m_q.clear();
+   std::vector<CPointCharge*>::iterator i1;
+   for (i1 = m_simcharges.begin(); i1 != m_simcharges.end(); i1++)
+      (*i1)->Sample(m_pos, m_q);
+   
+   for (unsigned int j = 0; j < m_pos.size(); j++)
+      Wrap(m_pos[j].x, m_pos[j].y);
+   
+   Limits(cutoff, mesh);
+   m_cutoff = cutoff;
+   m_mesh = mesh;
+   m_alpha = sqrt(-log(EWALD_TOL)) / m_cutoff;
+   
+   // Cell list for the real-space sum
+   m_cellsX = max(1, (int)(m_lx / m_cutoff));
+   m_cellsY = max(1, (int)(m_ly / m_cutoff));
+   m_cellHead.assign(m_cellsX * m_cellsY, -1);
+   m_cellNext.assign(m_pos.size(), -1);
+   for (unsigned int j = 0; j < m_pos.size(); j++)
+   {
+      int cx = min(m_cellsX - 1, (int)(m_pos[j].x / m_lx * m_cellsX));
+      int cy = min(m_cellsY - 1, (int)((m_pos[j].y - MENU_H) / m_ly * m_cellsY));
+      m_cellNext[j] = m_cellHead[cy*m_cellsX + cx];
+      m_cellHead[cy*m_cellsX + cx] = j;
+   }
+   
+   int M = m_mesh;
+   
+   // Spread the charges onto the mesh
+   std::vector<std::complex<double> > Q(M*M);
+   for (unsigned int j = 0; j < m_pos.size(); j++)
+   {
+      int fx, fy;
+      double wx[4], wy[4], dw[4];
+      Spline(m_pos[j].x / m_lx * M, fx, wx, dw);
+      Spline((m_pos[j].y - MENU_H) / m_ly * M, fy, wy, dw);
+      
+      for (int b = 0; b < 4; b++)
+      {
+         int gy = ((fy - b) % M + M) % M;
+         for (int a = 0; a < 4; a++)
+         {
+            int gx = ((fx - a) % M + M) % M;
+            Q[gy*M + gx] += m_q[j] * wx[a] * wy[b];
+         }
+      }
+   }
+   
+   for (int y = 0; y < M; y++) FFT(&Q[y*M], M, 1, false);
+   for (int x = 0; x < M; x++) FFT(&Q[x], M, M, false);
+   
+   // B-spline interpolation correction, |b(m)|^2
+   std::vector<double> bsq(M);
+   for (int m = 0; m < M; m++)
+   {
+      std::complex<double> d(0.0, 0.0);
+      double mk[3] = { 1.0/6, 4.0/6, 1.0/6 };
+      for (int k = 0; k < 3; k++)
+         d += mk[k] * std::polar(1.0, 2*PI*m*k / M);
+      bsq[m] = 1.0 / std::norm(d);
+   }
+   
+   // Convolve with the long-range kernel; k = 0 only shifts the 
+   //    potential by a constant, so it is dropped
+   for (int my = 0; my < M; my++)
+   {
+      double ky = 2*PI * (my < M/2 ? my : my - M) / m_ly;
+      for (int mx = 0; mx < M; mx++)
+      {
+         double kx = 2*PI * (mx < M/2 ? mx : mx - M) / m_lx;
+         double k = sqrt(kx*kx + ky*ky);
+         double g = 0.0;
+         if (k > 0.0)
+            g = 2*PI / (m_lx*m_ly) * erfc(k / (2*m_alpha)) / k * bsq[mx] * bsq[my];
+         Q[my*M + mx] *= g;
+      }
+   }
+   
+   for (int y = 0; y < M; y++) FFT(&Q[y*M], M, 1, true);
+   for (int x = 0; x < M; x++) FFT(&Q[x], M, M, true);
+   
+   m_phi.resize(M*M);
+   for (int i = 0; i < M*M; i++) m_phi[i] = Q[i].real();
+   
+   m_version = sceneVersion;
+   m_built = true;
+}
+
+/*********************************************************************/
+/* Short-range part: softened point charge minus the smooth part the */
+/*    mesh already accounts for.                                     */
+/*********************************************************************/
+void CEwaldSolver::RealSpace(double x, double y, cVector3d& field, double& phi)
+{
+   double soft = sqrt(SOFTEN_RR);
+   double rc2 = m_cutoff * m_cutoff;
+   double g0 = 2*m_alpha / sqrt(PI);
+   
+   int cx = min(m_cellsX - 1, (int)(x / m_lx * m_cellsX));
+   int cy = min(m_cellsY - 1, (int)((y - MENU_H) / m_ly * m_cellsY));
+   
+   // Neighbouring cells, each visited once even in a narrow grid
+   int nx = min(3, m_cellsX), ny = min(3, m_cellsY);
+   for (int b = 0; b < ny; b++)
+   {
+      int cellY = (ny < 3) ? b : (cy + b - 1 + m_cellsY) % m_cellsY;
+      for (int a = 0; a < nx; a++)
+      {
+         int cellX = (nx < 3) ? a : (cx + a - 1 + m_cellsX) % m_cellsX;
+         
+         for (int j = m_cellHead[cellY*m_cellsX + cellX]; j >= 0; j = m_cellNext[j])
+         {
+            // Nearest image
+            double rx = x - m_pos[j].x, ry = y - m_pos[j].y;
+            rx -= m_lx * floor(rx / m_lx + 0.5);
+            ry -= m_ly * floor(ry / m_ly + 0.5);
+            double rr = rx*rx + ry*ry;
+            if (rr > rc2) continue;
+            
+            double r = sqrt(rr);
+            if (r < 1e-6)
+            {
+               phi += m_q[j] * (2/soft - g0);
+               continue;
+            }
+            
+            double ar = m_alpha * r;
+            double g = g0 * exp(-ar*ar);
+            double er, ph;
+            if (r >= soft)
+            {
+               er = erfc(ar) / rr + g / r;
+               ph = erfc(ar) / r;
+            }
+            else
+            {
+               er = 1/SOFTEN_RR - erf(ar) / rr + g / r;
+               ph = 1/soft + (soft - r) / SOFTEN_RR - erf(ar) / r;
+            }
+            
+            field += cVector3d(rx, ry, 0) * (m_q[j] * er / r);
+            phi += m_q[j] * ph;
+         }
+      }
+   }
+}
+
+/*********************************************************************/
+/* Long-range part, interpolated from the mesh with the same splines */
+/*    used to spread the charges.                                    */
+/*********************************************************************/
+void CEwaldSolver::Mesh(double x, double y, cVector3d& field, double& phi)
+{
+   int M = m_mesh;
+   int fx, fy;
+   double wx[4], wy[4], dwx[4], dwy[4];
+   Spline(x / m_lx * M, fx, wx, dwx);
+   Spline((y - MENU_H) / m_ly * M, fy, wy, dwy);
+   
+   double ex = 0.0, ey = 0.0;
+   for (int b = 0; b < 4; b++)
+   {
+      int gy = ((fy - b) % M + M) % M;
+      for (int a = 0; a < 4; a++)
+      {
+         int gx = ((fx - a) % M + M) % M;
+         double p = m_phi[gy*M + gx];
+         phi += wx[a] * wy[b] * p;
+         ex -= dwx[a] * wy[b] * p;
+         ey -= wx[a] * dwy[b] * p;
+      }
+   }
+   
+   field += cVector3d(ex * M / m_lx, ey * M / m_ly, 0.0);
+}
+
+/*********************************************************************/
+/* Periodic (unscaled) E-field at the given point.                   */
+/*********************************************************************/
+cVector3d CEwaldSolver::Field(float x, float y)
+{
+   cVector3d field(0.0, 0.0, 0.0);
+   double phi = 0.0;
+   if (m_built == false) return field;
+   
+   double px = x, py = y;
+   Wrap(px, py);
+   RealSpace(px, py, field, phi);
+   Mesh(px, py, field, phi);
+   
+   return field;
+}
+
+/*********************************************************************/
+/* Periodic (unscaled) potential, up to a constant.                  */
+/*********************************************************************/
+double CEwaldSolver::Potential(float x, float y)
+{
+   cVector3d field(0.0, 0.0, 0.0);
+   double phi = 0.0;
+   if (m_built == false) return phi;
+   
+   double px = x, py = y;
+   Wrap(px, py);
+   RealSpace(px, py, field, phi);
+   Mesh(px, py, field, phi);
+   
+   return phi;
+}
+
+/*********************************************************************/
+/* Reference field: plain sum over (2*shells+1)^2 copies of the cell.*/
+/*********************************************************************/
+cVector3d CEwaldSolver::BruteField(float x, float y, int shells)
+{
+   cVector3d field(0.0, 0.0, 0.0);
+   
+   for (int ny = -shells; ny <= shells; ny++)
+   {
+      for (int nx = -shells; nx <= shells; nx++)
+      {
+         for (unsigned int j = 0; j < m_pos.size(); j++)
+         {
+            double rx = x - (m_pos[j].x + nx*m_lx);
+            double ry = y - (m_pos[j].y + ny*m_ly);
+            double rr = rx*rx + ry*ry;
+            if (rr < 1e-12) continue;
+            double irr = 1 / (rr <= SOFTEN_RR ? SOFTEN_RR : rr);
+            field += cVector3d(rx, ry, 0) * (m_q[j] * irr / sqrt(rr));
+         }
+      }
+   }
+   
+   return field;
+}
+
+CEwaldSolver ewald;
+
+/*********************************************************************/
+/* Rebuild the periodic mesh if the scene or settings have changed.  */
+/*********************************************************************/
+void UpdatePeriodicMesh()
+{
+   if (periodicMode == false) return;
+   if (ewald.m_built && ewald.m_version == sceneVersion) return;
+   
+   pthread_mutex_lock(&sceneMutex);
+   ewald.Build(ewaldCutoff, ewaldMesh);
+   pthread_mutex_unlock(&sceneMutex);
+}
+
+/*********************************************************************/
+/* Compare the periodic solver with a brute-force image sum at a set */
+/*    of random probes, and time both.                               */
+/*********************************************************************/
+void EwaldReport(int probes)
+{
+   // Only the build needs the scene; the slow comparison runs on a 
+   //    private copy so the field thread is never held up by it
+   CEwaldSolver check;
+   pthread_mutex_lock(&sceneMutex);
+   double t0 = SimNow();
+   check.Build(ewaldCutoff, ewaldMesh);
+   double tBuild = SimNow() - t0;
+   pthread_mutex_unlock(&sceneMutex);
+   
+   double netCharge = 0.0;
+   for (unsigned int j = 0; j < check.m_q.size(); j++) netCharge += check.m_q[j];
+   
+   // Same probes every time, without touching the global rand() state
+   unsigned int seed = 1;
+   std::vector<cVector3d> pts(probes);
+   for (int i = 0; i < probes; i++)
+      pts[i] = cVector3d(rand_r(&seed) % VIEWPORT_W, 
+                         MENU_H + rand_r(&seed) % (VIEWPORT_H - MENU_H), 0.0);
+   
+   double err = 0, ref = 0, conv = 0, worst = 0;
+   t0 = SimNow();
+   std::vector<cVector3d> brute(probes);
+   for (int i = 0; i < probes; i++)
+      brute[i] = check.BruteField(pts[i].x, pts[i].y, IMAGE_SHELLS);
+   double tBrute = (SimNow() - t0) / probes;
+   
+   for (int i = 0; i < probes; i++)
+   {
+      cVector3d half = check.BruteField(pts[i].x, pts[i].y, IMAGE_SHELLS/2);
+      cVector3d e = check.Field(pts[i].x, pts[i].y) - brute[i];
+      err += e.lengthsq();
+      ref += brute[i].lengthsq();
+      conv += (half - brute[i]).lengthsq();
+      if (e.length() > worst) worst = e.length();
+   }
+   
+   int reps = 100000 / probes + 1;
+   t0 = SimNow();
+   for (int r = 0; r < reps; r++)
+      for (int i = 0; i < probes; i++)
+         check.Field(pts[i].x, pts[i].y);
+   double tEwald = (SimNow() - t0) / (reps * probes);
+   
+   double rms = sqrt(ref / probes);
+   printf("Periodic field check: %d point charges (net %.2f), %d probes\n", 
+          (int)check.m_q.size(), netCharge, probes);
+   printf("  cutoff %.1f  alpha %.4f  mesh %dx%d\n", 
+          check.m_cutoff, check.m_alpha, check.m_mesh, check.m_mesh);
+   printf("  error vs %d image shells: rms %.2e  max %.2e (relative to rms field)\n", 
+          IMAGE_SHELLS, sqrt(err / probes) / rms, worst / rms);
+   printf("  image sum change from %d to %d shells: rms %.2e\n", 
+          IMAGE_SHELLS/2, IMAGE_SHELLS, sqrt(conv / probes) / rms);
+   printf("  cost: mesh build %.2f ms, probe %.2f us, image sum probe %.2f ms\n", 
+          tBuild * 1e3, tEwald * 1e6, tBrute * 1e3);
+}
+
+/*********************************************************************/
+/* Run the accuracy report off the GLUT thread, one at a time.       */
+/*********************************************************************/
+volatile bool ewaldReportRunning;
+
+void* EwaldReportLoop(void* a_pUserData)
+{
+   EwaldReport(32);
+   ewaldReportRunning = false;
+   return NULL;
+}
+
+/*********************************************************************/
+/* Headless accuracy check on a small crystal, for -ewaldcheck.      */
+/*********************************************************************/
+int RunEwaldCheck()
+{
+   // Rock salt lattice with a vacancy, plus a pair of opposite wires
+   for (int j = 0; j < 6; j++)
+      for (int i = 0; i < 8; i++)
+         if (i != 3 || j != 2)
+            m_simcharges.push_back(NewCharge(SHAPE_POINT, 50 + 100*i, 
+                                             MENU_H + 46 + 92*j, ((i + j) % 2) ? -1 : 1));
+   m_simcharges.push_back(NewCharge(SHAPE_SEGMENT, 410, 270, 1));
+   m_simcharges.push_back(NewCharge(SHAPE_SEGMENT, 410, 230, -1));
+   
+   EwaldReport(64);
+   return 0;
+}
+
+/*********************************************************************/
+/* Return the raw (unclamped) E-field vector at the given point.     */
+/*********************************************************************/
+cVector3d GetField(float x, float y)
+{
+   cVector3d totVecForce(0.0, 0.0, 0.0);
+   
+   // Charges and all their periodic images
+   if (periodicMode) return 1000 * ewald.Field(x, y);
+   
+   // For each of the charges in the simulation window
+   std::vector<CPointCharge*>::iterator i1;
+   for (i1 = m_simcharges.begin(); i1 != m_simcharges.end(); i1++)
+   {
+      CPointCharge* c = (*i1);
+      
+      // Scale and add to force accumulator
+      totVecForce += 1000 * c->Field(x, y);
+   }
+   
+   return totVecForce;
+}
+
+/*********************************************************************/
+/* Return the potential at the given point, scaled like GetField().  */
+/*********************************************************************/
+double GetPotential(float x, float y)
+{
+   double phi = 0.0;
+   
+   if (periodicMode) return 1000 * ewald.Potential(x, y);
+   
+   std::vector<CPointCharge*>::iterator i1;
+   for (i1 = m_simcharges.begin(); i1 != m_simcharges.end(); i1++)
+      phi += 1000 * (*i1)->Potential(x, y);
+   
+   return phi;
+}
+
+/*********************************************************************/
+/* Turn a field vector into something safe to send to the device.    */
+/*********************************************************************/
+cVector3d DeviceForce(cVector3d totVecForce, float z)
+{
+   // TODO: Attach a spring to keep the cursor in the z-plane
+   totVecForce += cVector3d(0, 0, -z);
+   
+   /* Clamp forces before sending to haptice device */
+   if (totVecForce.x > 4)  totVecForce.x = 4;
+   if (totVecForce.x < -4) totVecForce.x = -4;
+   if (totVecForce.y > 4)  totVecForce.y = 4;
+   if (totVecForce.y < -4) totVecForce.y = -4;
+   if (totVecForce.z > 10)  totVecForce.z = 10;
+   if (totVecForce.z < -10) totVecForce.z = -10;
+   
+   return totVecForce;
+}
+
+/*********************************************************************/
+/* Return the E-field vector at the given point.                     */
+/*********************************************************************/
+cVector3d GetForce(float x, float y, float z)
+{
+   return DeviceForce(GetField(x, y), z);
+}
+
+/*********************************************************************/
+/* Read batches from one stream connection until it closes.  Only    */
+/*    complete batches are queued, so a batch is never split across  */
+/*    frames.                                                        */
+/*********************************************************************/
+void ReadStream(int fd)
+{
+   std::vector<char> buf;
+   char chunk[65536];
+   
+   for (;;)
+   {
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n <= 0) return;
+      buf.insert(buf.end(), chunk, chunk + n);
+      
+      // Peel off all complete batches
+      size_t used = 0;
+      std::vector<StreamRecord> batch;
+      while (buf.size() - used >= sizeof(StreamBatchHeader))
+      {
+         StreamBatchHeader h;
+         memcpy(&h, &buf[used], sizeof(h));
+         if (h.magic != STREAM_MAGIC || h.count > STREAM_MAX_BATCH)
+         {
+            fprintf(stderr, "Scene stream: bad batch header, dropping connection\n");
+            return;
+         }
+         
+         size_t len = sizeof(h) + h.count * sizeof(StreamRecord);
+         if (buf.size() - used < len) break;
+         
+         size_t first = batch.size();
+         batch.resize(first + h.count);
+         if (h.count > 0)
+            memcpy(&batch[first], &buf[used + sizeof(h)], 
+                   h.count * sizeof(StreamRecord));
+         used += len;
+      }
+      buf.erase(buf.begin(), buf.begin() + used);
+      
+      if (batch.empty()) continue;
+      
+      pthread_mutex_lock(&streamMutex);
+      m_streampending.insert(m_streampending.end(), batch.begin(), batch.end());
+      pthread_mutex_unlock(&streamMutex);
+   }
+}
+
+/*********************************************************************/
+/* Stream reader thread.  Blocks on input so the render and haptic   */
+/*    loops never have to.                                           */
+/*********************************************************************/
+void* StreamLoop(void* a_pUserData)
+{
+   if (streamIsSocket == false)
+   {
+      ReadStream(streamFd);
+      return NULL;
+   }
+   
+   // Serve one client at a time, forever
+   for (;;)
+   {
+      int client = accept(streamFd, NULL, NULL);
+      if (client < 0) continue;
+      ReadStream(client);
+      close(client);
+   }
+   return NULL;
+}
+
+/*********************************************************************/
+/* Start listening for scene updates on stdin ("-") or a Unix socket.*/
+/*********************************************************************/
+bool StartStream(const char *path)
+{
+   if (strcmp(path, "-") == 0)
+   {
+      streamFd = 0;
+      streamIsSocket = false;
+   }
+   else
+   {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+      
+      // Clear out a stale socket from an earlier run, but nothing else
+      struct stat st;
+      if (lstat(path, &st) == 0)
+      {
+         if (!S_ISSOCK(st.st_mode))
+         {
+            fprintf(stderr, "Scene stream: %s exists and is not a socket\n", path);
+            return false;
+         }
+         unlink(path);
+      }
+      
+      streamFd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (streamFd < 0 || 
+          bind(streamFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+          listen(streamFd, 1) < 0)
+      {
+         perror("Scene stream");
+         return false;
+      }
+      streamIsSocket = true;
    }
    
-   return NULL;
+   return pthread_create(&streamThread, NULL, StreamLoop, NULL) == 0;
 }
 
 /*********************************************************************/
-/* Iterate through all the charges, and draw them to the screen.     */
+/* Apply everything that arrived since the last frame.  Updates are  */
+/*    coalesced per charge id first, then applied under one lock so  */
+/*    the haptic thread sees either the old scene or the new one.    */
 /*********************************************************************/
-void DrawSimCharges()
+void ApplyStreamUpdates()
 {
-   std::vector<CPointCharge*>::iterator i1;
-   for (i1 = m_simcharges.begin(); i1 != m_simcharges.end(); i1++)
+   std::vector<StreamRecord> records;
+   
+   pthread_mutex_lock(&streamMutex);
+   records.swap(m_streampending);
+   pthread_mutex_unlock(&streamMutex);
+   
+   // Report the rate we are actually applying, once a second
+   double now = SimNow();
+   if (streamReportTime == 0.0) streamReportTime = now;
+   if (now - streamReportTime >= 1.0)
    {
-      CPointCharge* c = (*i1);
-      c->Draw();
+      if (streamReceived > 0)
+         printf("Scene stream: %.0f updates/s received, %.0f/s applied "
+                "after coalescing\n", streamReceived / (now - streamReportTime), 
+                streamApplied / (now - streamReportTime));
+      if (streamRejected > 0)
+         printf("Scene stream: %ld records with bad coordinates dropped\n", 
+                streamRejected);
+      streamReceived = streamApplied = streamRejected = 0;
+      streamReportTime = now;
+   }
+   
+   if (records.empty()) return;
+   
+   // Coalesce: only the last word on each id matters, and on each of
+   //    its handles.  Handles are offsets, so they don't care about
+   //    moves, but a new or removed charge forgets them.
+   bool clearAll = false;
+   std::map<uint32_t, StreamRecord> last;
+   std::map<std::pair<uint32_t, int>, StreamRecord> handles;
+   for (unsigned int i = 0; i < records.size(); i++)
+   {
+      StreamRecord& r = records[i];
+      
+      if (r.op == STREAM_CLEAR)
+      {
+         clearAll = true;
+         last.clear();
+         handles.clear();
+         continue;
+      }
+      
+      // Coordinates become ints, and the label is a single digit
+      if ((r.op == STREAM_ADD || r.op == STREAM_MOVE || r.op == STREAM_VERTEX) && 
+          !(fabs(r.x) <= STREAM_MAX_COORD && fabs(r.y) <= STREAM_MAX_COORD))
+      {
+         streamRejected++;
+         continue;
+      }
+      if (r.charge > STREAM_MAX_CHARGE) r.charge = STREAM_MAX_CHARGE;
+      if (r.charge < -STREAM_MAX_CHARGE) r.charge = -STREAM_MAX_CHARGE;
+      
+      std::map<uint32_t, StreamRecord>::iterator l = last.find(r.id);
+      if (r.op == STREAM_VERTEX)
+      {
+         if (l != last.end() && l->second.op == STREAM_REMOVE) continue;
+         handles[std::make_pair(r.id, (int)r.index)] = r;
+      }
+      else if (r.op == STREAM_MOVE && l != last.end())
+      {
+         // Fold into an earlier add or move; a removed charge stays gone
+         if (l->second.op == STREAM_REMOVE) continue;
+         l->second.x = r.x; l->second.y = r.y;
+      }
+      else if (r.op == STREAM_ADD || r.op == STREAM_MOVE || r.op == STREAM_REMOVE)
+      {
+         last[r.id] = r;
+         if (r.op != STREAM_MOVE)
+            handles.erase(handles.lower_bound(std::make_pair(r.id, 0)), 
+                          handles.upper_bound(std::make_pair(r.id, 255)));
+      }
+   }
+   
+   streamReceived += records.size();
+   streamApplied += last.size() + handles.size() + (clearAll ? 1 : 0);
+   
+   pthread_mutex_lock(&sceneMutex);
+   
+   // Charges to drop, removed from m_simcharges in a single pass
+   std::vector<CPointCharge*> dead;
+   
+   if (clearAll)
+   {
+      std::map<uint32_t, CPointCharge*>::iterator c;
+      for (c = m_streamcharges.begin(); c != m_streamcharges.end(); c++)
+         dead.push_back(c->second);
+      m_streamcharges.clear();
+   }
+   
+   std::map<uint32_t, StreamRecord>::iterator l;
+   for (l = last.begin(); l != last.end(); l++)
+   {
+      StreamRecord& r = l->second;
+      std::map<uint32_t, CPointCharge*>::iterator c = m_streamcharges.find(r.id);
+      
+      switch (r.op)
+      {
+         case STREAM_ADD:
+         {
+            if (c != m_streamcharges.end()) dead.push_back(c->second);
+            CPointCharge *d;
+            if (r.shape == SHAPE_POLYLINE && r.index >= 2)
+            {
+               // Vertices all start on the anchor, for STREAM_VERTEX
+               CLineCharge *line = new CLineCharge((int)r.x, (int)r.y, r.charge);
+               for (int k = 0; k < r.index; k++) line->AddVertex(0, 0);
+               d = line;
+            }
+            else
+               d = NewCharge(r.shape, (int)r.x, (int)r.y, r.charge);
+            m_simcharges.push_back(d);
+            m_streamcharges[r.id] = d;
+            break;
+         }
+         case STREAM_MOVE:
+         {
+            if (c == m_streamcharges.end()) break;
+            c->second->m_x = (int)r.x; c->second->m_y = (int)r.y;
+            c->second->pos.x = (int)r.x; c->second->pos.y = (int)r.y;
+            break;
+         }
+         case STREAM_REMOVE:
+         {
+            if (c == m_streamcharges.end()) break;
+            dead.push_back(c->second);
+            m_streamcharges.erase(c);
+            break;
+         }
+      }
+   }
+   
+   // Reshape what is left, now that every add has happened
+   std::map<std::pair<uint32_t, int>, StreamRecord>::iterator h;
+   for (h = handles.begin(); h != handles.end(); h++)
+   {
+      std::map<uint32_t, CPointCharge*>::iterator c = m_streamcharges.find(h->first.first);
+      if (c == m_streamcharges.end()) continue;
+      CPointCharge *d = c->second;
+      d->MoveHandle(h->second.index, d->pos.x + h->second.x, d->pos.y + h->second.y);
+   }
+   
+   if (!dead.empty())
+   {
+      std::sort(dead.begin(), dead.end());
+      std::vector<CPointCharge*>::iterator keep = m_simcharges.begin();
+      std::vector<CPointCharge*>::iterator i1;
+      for (i1 = m_simcharges.begin(); i1 != m_simcharges.end(); i1++)
+      {
+         if (std::binary_search(dead.begin(), dead.end(), *i1)) continue;
+         *keep++ = *i1;
+      }
+      m_simcharges.erase(keep, m_simcharges.end());
+      
+      // Don't leave the mouse holding on to a deleted charge
+      if (std::binary_search(dead.begin(), dead.end(), selectedCharge))
+      {
+         selectedCharge = NULL;
+         enableDragging = false;
+         glutMotionFunc(NULL);
+      }
+      
+      for (i1 = dead.begin(); i1 != dead.end(); i1++)
+         delete *i1;
    }
+   
+   sceneVersion++;
+   pthread_mutex_unlock(&sceneMutex);
 }
 
 /*********************************************************************/
-/* Iterate through all the charges, and draw them to the screen      */
+/* Queue one record, as the stream reader would.                     */
 /*********************************************************************/
-void DrawMenuCharges()
+void QueueStreamRecord(int op, uint32_t id, float x, float y, int charge)
 {
-   std::vector<CPointCharge*>::iterator i1;
-   for (i1 = m_menucharges.begin(); i1 != m_menucharges.end(); i1++)
-   {
-      CPointCharge* c = (*i1);
-      c->Draw();
-   }
+   StreamRecord r;
+   memset(&r, 0, sizeof(r));
+   r.op = op;
+   r.shape = SHAPE_POINT;
+   r.charge = charge;
+   r.id = id;
+   r.x = x; r.y = y;
+   
+   pthread_mutex_lock(&streamMutex);
+   m_streampending.push_back(r);
+   pthread_mutex_unlock(&streamMutex);
 }
 
 /*********************************************************************/
-/* Return the E-field vector at the given point.                     */
+/* Replay add/move/remove orderings through ApplyStreamUpdates() and */
+/*    check the scene each frame.  Invoked with -streamcheck.        */
 /*********************************************************************/
-cVector3d GetForce(float x, float y, float z)
+int RunStreamCheck()
 {
-   cVector3d totVecForce(0.0, 0.0, 0.0);
+   int failures = 0;
    
-   // For each of the charges in the simulation window
-   std::vector<CPointCharge*>::iterator i1;
-   for (i1 = m_simcharges.begin(); i1 != m_simcharges.end(); i1++)
+   // Each step is one frame: records, then the expected scene
+   struct Step {
+      const char *name;
+      int ops[4][3];        // op, id, x; op 0 ends the list
+      int count;            // Expected number of charges afterwards
+      int id, x;            // A charge that must exist at x, or id < 0
+   };
+   Step steps[] = {
+      { "add",                {{STREAM_ADD, 7, 100}},                       1,  7, 100 },
+      { "remove then move",   {{STREAM_REMOVE, 7, 0}, {STREAM_MOVE, 7, 150}}, 0, -1, 0 },
+      { "add then move",      {{STREAM_ADD, 8, 100}, {STREAM_MOVE, 8, 200}}, 1,  8, 200 },
+      { "add then remove",    {{STREAM_ADD, 9, 100}, {STREAM_REMOVE, 9, 0}}, 1,  8, 200 },
+      { "move, remove, add",  {{STREAM_MOVE, 8, 250}, {STREAM_REMOVE, 8, 0}, 
+                               {STREAM_ADD, 8, 300}},                        1,  8, 300 },
+      { "move twice",         {{STREAM_MOVE, 8, 310}, {STREAM_MOVE, 8, 320}}, 1,  8, 320 },
+      { "move unknown id",    {{STREAM_MOVE, 11, 100}},                      1,  8, 320 },
+      { "clear then add",     {{STREAM_ADD, 12, 100}, {STREAM_CLEAR, 0, 0}, 
+                               {STREAM_ADD, 10, 400}, {STREAM_MOVE, 12, 0}}, 1, 10, 400 },
+   };
+   
+   for (unsigned int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++)
    {
-      // Determine 1/distance^2 between point charge and probe
-      CPointCharge* c = (*i1);
-      
-      // Get the distance vector
-      cVector3d r = cVector3d(x, y, 0) - c->pos;
+      Step& st = steps[i];
+      for (int k = 0; k < 4 && st.ops[k][0] != 0; k++)
+         QueueStreamRecord(st.ops[k][0], st.ops[k][1], st.ops[k][2], 300, 1);
       
-      // Find inverse of r^2
-      float rr = r.lengthsq();
-      if (rr <= 225.0) rr = 225.0;
-      float irr = 1/rr;
-      float sirr = c->m_charge * irr;
-      //printf("total dist: %f %f\n", r.x, r.y );
-      r.normalize();
+      unsigned int version = sceneVersion;
+      ApplyStreamUpdates();
       
-      // Convert scalar back into vector
-      cVector3d forceVec = r * sirr;
+      bool ok = ((int)m_simcharges.size() == st.count) && 
+                (sceneVersion == version + 1);
+      if (st.id >= 0)
+      {
+         std::map<uint32_t, CPointCharge*>::iterator c = m_streamcharges.find(st.id);
+         ok = ok && c != m_streamcharges.end() && c->second->m_x == st.x;
+      }
       
-      // Scale and add to force accumulator
-      totVecForce += 1000 * forceVec;
+      printf("  %-20s %s\n", st.name, ok ? "ok" : "FAILED");
+      if (!ok) failures++;
    }
    
-   // TODO: Attach a spring to keep the cursor in the z-plane
-   totVecForce += cVector3d(0, 0, -z);
+   // Bad input from the wire: charge 10 sits at x = 400 from above
+   QueueStreamRecord(STREAM_MOVE, 10, NAN, 300, 1);
+   QueueStreamRecord(STREAM_ADD, 13, 1e30, 300, 1);
+   QueueStreamRecord(STREAM_ADD, 14, 100, 300, 100);
+   QueueStreamRecord(STREAM_MOVE, 14, 200, -INFINITY, 1);
+   ApplyStreamUpdates();
    
-   /* Clamp forces before sending to haptice device */
-   if (totVecForce.x > 4)  totVecForce.x = 4;
-   if (totVecForce.x < -4) totVecForce.x = -4;
-   if (totVecForce.y > 4)  totVecForce.y = 4;
-   if (totVecForce.y < -4) totVecForce.y = -4;
-   if (totVecForce.z > 10)  totVecForce.z = 10;
-   if (totVecForce.z < -10) totVecForce.z = -10;
+   std::map<uint32_t, CPointCharge*>::iterator c10 = m_streamcharges.find(10);
+   std::map<uint32_t, CPointCharge*>::iterator c14 = m_streamcharges.find(14);
+   bool ok = m_simcharges.size() == 2 && m_streamcharges.count(13) == 0 && 
+             c10 != m_streamcharges.end() && c10->second->m_x == 400 && 
+             c14 != m_streamcharges.end() && c14->second->m_x == 100 && 
+             c14->second->m_charge == STREAM_MAX_CHARGE;
+   printf("  %-20s %s\n", "bad coords, charge", ok ? "ok" : "FAILED");
+   if (!ok) failures++;
    
-   return totVecForce;
+   // Shapes: a polyline built from vertex records and moved after it
+   //    was shaped, and a ring whose only vertex came before its add
+   StreamRecord geo[] = {
+      { STREAM_VERTEX, 0, 0, 0, 21, 0, 30 },
+      { STREAM_ADD, SHAPE_POLYLINE, 2, 3, 20, 300, 300 },
+      { STREAM_VERTEX, 0, 0, 0, 20, 7, 7 },
+      { STREAM_VERTEX, 0, 0, 1, 20, 0, 40 },
+      { STREAM_VERTEX, 0, 0, 2, 20, 50, 0 },
+      { STREAM_MOVE, 0, 0, 0, 20, 310, 300 },
+      { STREAM_VERTEX, 0, 0, 0, 20, -50, 0 },
+      { STREAM_ADD, SHAPE_RING, 1, 0, 21, 500, 300 },
+   };
+   pthread_mutex_lock(&streamMutex);
+   m_streampending.insert(m_streampending.end(), geo, geo + sizeof(geo) / sizeof(geo[0]));
+   pthread_mutex_unlock(&streamMutex);
+   ApplyStreamUpdates();
+   
+   CLineCharge *poly = (CLineCharge*)m_streamcharges[20];
+   CRingCharge *ring = (CRingCharge*)m_streamcharges[21];
+   ok = m_simcharges.size() == 4 && poly->m_x == 310 && 
+        poly->m_vertices.size() == 3 && poly->m_vertices[0].x == -50 && 
+        poly->m_vertices[1].y == 40 && poly->m_vertices[2].x == 50 && 
+        ring->m_ringRadius == 60;
+   printf("  %-20s %s\n", "shape vertices", ok ? "ok" : "FAILED");
+   if (!ok) failures++;
+   
+   // One vertex on its own, and the ring's radius
+   QueueStreamRecord(STREAM_VERTEX, 21, 0, 80, 1);
+   geo[3].y = -40;
+   pthread_mutex_lock(&streamMutex);
+   m_streampending.push_back(geo[3]);
+   pthread_mutex_unlock(&streamMutex);
+   ApplyStreamUpdates();
+   
+   ok = poly->m_vertices[0].x == -50 && poly->m_vertices[1].y == -40 && 
+        ring->m_ringRadius == 80;
+   printf("  %-20s %s\n", "reshape", ok ? "ok" : "FAILED");
+   if (!ok) failures++;
+   
+   // A vertex for a removed charge doesn't bring it back
+   QueueStreamRecord(STREAM_REMOVE, 21, 0, 0, 1);
+   QueueStreamRecord(STREAM_VERTEX, 21, 0, 90, 1);
+   ApplyStreamUpdates();
+   
+   ok = m_simcharges.size() == 3 && m_streamcharges.count(21) == 0;
+   printf("  %-20s %s\n", "remove then vertex", ok ? "ok" : "FAILED");
+   if (!ok) failures++;
+   
+   printf("Stream replay: %d failure(s)\n", failures);
+   return failures ? 1 : 0;
 }
 
 /*********************************************************************/
@@ -320,6 +1944,13 @@ void DrawMenu(void)
    
    // Place sphere charges
    DrawMenuCharges();
+   
+   // Label the empty middle slot with the shape being dragged out
+   const char *names[NUM_SHAPES] = { "pt", "seg", "poly", "ring" };
+   glColor3f(0.0f, 0.0f, 0.0f);
+   glRasterPos2i(VIEWPORT_W/2 - 8, MENU_H/2 - 4);
+   for (const char *n = names[chargeShape]; *n; n++)
+      glutBitmapCharacter(GLUT_BITMAP_HELVETICA_10, *n);
 }
 
 /*********************************************************************/
@@ -366,6 +1997,21 @@ void DrawFieldVectors()
    }
 }
 
+/*********************************************************************/
+/* Wrap a point that left the simulation window back into it.        */
+/*********************************************************************/
+bool WrapToWindow(cVector3d& w)
+{
+   bool wrapped = false;
+   
+   if (w.x < 0)          { w.x += VIEWPORT_W; wrapped = true; }
+   if (w.x > VIEWPORT_W) { w.x -= VIEWPORT_W; wrapped = true; }
+   if (w.y < MENU_H)     { w.y += VIEWPORT_H - MENU_H; wrapped = true; }
+   if (w.y > VIEWPORT_H) { w.y -= VIEWPORT_H - MENU_H; wrapped = true; }
+   
+   return wrapped;
+}
+
 /*********************************************************************/
 /* Draw field line that passes through the given x, y.               */
 /*     Euler's method is used to numerically solve the IVP           */
@@ -403,8 +2049,21 @@ void DrawFieldLine(float x, float y)
          glColor3f(color+=0.001, 0, 0);
          glVertex2f(w0.x, w0.y);
          
-         if ((w0.x < 0) || (w0.x > VIEWPORT_W)) break;
-         if ((w0.y < MENU_H) || (w0.y > VIEWPORT_H)) break;
+         if (periodicMode)
+         {
+            // Carry on from the opposite edge
+            if (WrapToWindow(w0))
+            {
+               glEnd();
+               glBegin(GL_LINE_STRIP);
+               glVertex2f(w0.x, w0.y);
+            }
+         }
+         else
+         {
+            if ((w0.x < 0) || (w0.x > VIEWPORT_W)) break;
+            if ((w0.y < MENU_H) || (w0.y > VIEWPORT_H)) break;
+         }
          if (CheckSimClick(w0.x, w0.y) != NULL) break;
       }
       glEnd();
@@ -419,7 +2078,7 @@ void DrawFieldLine(float x, float y)
       glVertex2f(f->x, f->y);
       
       // Draw until we go off the screen
-      for(i = 0; i < 1000; i++)
+      for(int i = 0; i < 1000; i++)
       {
          cVector3d force = GetForce(w0.x, w0.y, 0.0);
          force.normalize();
@@ -427,8 +2086,21 @@ void DrawFieldLine(float x, float y)
          //printf("w1.x: %f, w1.y: %f\n", w1.x, w1.y);
          glVertex2f(w0.x, w0.y);
          
-         if ((w0.x < 0) || (w0.x > VIEWPORT_W)) break;
-         if ((w0.y < MENU_H) || (w0.y > VIEWPORT_H)) break;
+         if (periodicMode)
+         {
+            // Carry on from the opposite edge
+            if (WrapToWindow(w0))
+            {
+               glEnd();
+               glBegin(GL_LINE_STRIP);
+               glVertex2f(w0.x, w0.y);
+            }
+         }
+         else
+         {
+            if ((w0.x < 0) || (w0.x > VIEWPORT_W)) break;
+            if ((w0.y < MENU_H) || (w0.y > VIEWPORT_H)) break;
+         }
          if (CheckSimClick(w0.x, w0.y) != NULL) break;
       }
       glEnd();
@@ -471,6 +2143,9 @@ void Reshape(int w, int h)
 /*********************************************************************/
 void Idle(void)
 {
+   ApplyStreamUpdates();
+   UpdatePeriodicMesh();
+   
    glClear(GL_COLOR_BUFFER_BIT);
    
    DrawMenu();
@@ -502,6 +2177,31 @@ void Kbd(unsigned char a, int x, int y)
    if (a == 'v') showFieldVector = !showFieldVector;
    if (a == 'l') showFieldLines = !showFieldLines;
    if (a == 'h') enableHaptics = !enableHaptics;
+   if (a == 's') chargeShape = (chargeShape + 1) % NUM_SHAPES;
+   
+   // Periodic mode and its settings
+   if (a == 'p' || a == 'm' || a == 'c')
+   {
+      pthread_mutex_lock(&sceneMutex);
+      if (a == 'p') periodicMode = !periodicMode;
+      if (a == 'm') ewaldMesh = (ewaldMesh >= 256) ? 16 : ewaldMesh * 2;
+      if (a == 'c') 
+         ewaldCutoff = (ewaldCutoff >= min(ewald.m_lx, ewald.m_ly) / 2) ? 50 : ewaldCutoff + 50;
+      ewald.Limits(ewaldCutoff, ewaldMesh);
+      sceneVersion++;
+      pthread_mutex_unlock(&sceneMutex);
+      printf("Periodic %s, cutoff %.0f, mesh %d\n", 
+             periodicMode ? "on" : "off", ewaldCutoff, ewaldMesh);
+   }
+   if (a == 'e' && ewaldReportRunning == false) 
+   {
+      pthread_t report;
+      ewaldReportRunning = true;
+      if (pthread_create(&report, NULL, EwaldReportLoop, NULL) == 0)
+         pthread_detach(report);
+      else
+         ewaldReportRunning = false;
+   }
    
 }
 
@@ -526,10 +2226,14 @@ void Mouse(int button, int state, int x, int y)
             if (c != NULL)
             {               
                // Duplicate the menu charge that the user clicked on            
-               CPointCharge *d = new CPointCharge(c->m_x, c->m_y, c->m_charge);
+               CPointCharge *d = NewCharge(chargeShape, c->m_x, c->m_y, c->m_charge);
+               pthread_mutex_lock(&sceneMutex);
                m_simcharges.push_back(d);
+               sceneVersion++;
+               pthread_mutex_unlock(&sceneMutex);
                
                selectedCharge = d;
+               selectedHandle = -1;
                
                // Turn on motionfunc to allow dragging of charge
                glutMotionFunc(Dragging);
@@ -540,8 +2244,10 @@ void Mouse(int button, int state, int x, int y)
             // Check to see if clicked on sim charge
             if (c != NULL)
             {
-               // Set selectedCharge to the clicked on charge
+               // Set selectedCharge to the clicked on charge; grabbing
+               //    a vertex or a ring's wire reshapes it instead
                selectedCharge = c;
+               selectedHandle = c->Handle(x, y);
                
                // Enable motionfunc to allow dragging of charge
                enableDragging = true;
@@ -598,6 +2304,7 @@ void MyInit(void)
    showFieldVector = false;
    showFieldLines = false;
    enableHaptics = false;
+   chargeShape = SHAPE_POINT;
 }
 
 /*********************************************************************/
@@ -624,8 +2331,325 @@ void InitMenu(void)
 void Dragging(int x, int y)
 {
    //printf("Motionfunc! X: %i Y: %i\n", x, y);
-   selectedCharge->m_x = x; selectedCharge->m_y = VIEWPORT_H - y;
-   selectedCharge->pos.x = x; selectedCharge->pos.y = VIEWPORT_H - y;
+   if (selectedCharge == NULL) return;
+   pthread_mutex_lock(&sceneMutex);
+   if (selectedHandle >= 0)
+      selectedCharge->MoveHandle(selectedHandle, x, VIEWPORT_H - y);
+   else
+   {
+      selectedCharge->m_x = x; selectedCharge->m_y = VIEWPORT_H - y;
+      selectedCharge->pos.x = x; selectedCharge->pos.y = VIEWPORT_H - y;
+   }
+   sceneVersion++;
+   pthread_mutex_unlock(&sceneMutex);
+}
+
+/*********************************************************************/
+/* First order model of the field around a point.  The slow field    */
+/*    thread fills these in, and the haptic tick extrapolates from   */
+/*    the latest one until the next arrives.                         */
+/*********************************************************************/
+class CFieldModel {
+public:
+   
+   CFieldModel();
+   
+   void Linearize(float x, float y);
+   cVector3d Field(const cVector3d& p) const;
+   double Potential(const cVector3d& p) const;
+   
+   bool m_valid;
+   unsigned int m_serial;    // Distinguishes one model from the next
+   cVector3d m_pos;          // Expansion point
+   cVector3d m_field;        // Field at m_pos
+   double m_jac[2][2];       // d(field)/d(pos), symmetrized
+   double m_potential;       // Potential at m_pos
+};
+
+CFieldModel::CFieldModel()
+{
+   m_valid = false;
+   m_serial = 0;
+   m_jac[0][0] = m_jac[0][1] = m_jac[1][0] = m_jac[1][1] = 0.0;
+   m_potential = 0.0;
+}
+
+/*********************************************************************/
+/* Evaluate the field, its Jacobian and the potential at (x, y).     */
+/*    The caller must hold sceneMutex.                               */
+/*********************************************************************/
+void CFieldModel::Linearize(float x, float y)
+{
+   double h = JACOBIAN_STEP;
+   cVector3d fx1 = GetField(x+h, y), fx0 = GetField(x-h, y);
+   cVector3d fy1 = GetField(x, y+h), fy0 = GetField(x, y-h);
+   
+   m_pos = cVector3d(x, y, 0);
+   m_field = GetField(x, y);
+   m_potential = GetPotential(x, y);
+   
+   // The field is a gradient, so its Jacobian is symmetric
+   double cross = ((fx1.y - fx0.y) + (fy1.x - fy0.x)) / (4*h);
+   m_jac[0][0] = (fx1.x - fx0.x) / (2*h);
+   m_jac[1][1] = (fy1.y - fy0.y) / (2*h);
+   m_jac[0][1] = m_jac[1][0] = cross;
+   
+   static unsigned int serial = 0;
+   m_serial = ++serial;
+   m_valid = true;
+}
+
+cVector3d CFieldModel::Field(const cVector3d& p) const
+{
+   double dx = p.x - m_pos.x, dy = p.y - m_pos.y;
+   
+   return cVector3d(m_field.x + m_jac[0][0]*dx + m_jac[0][1]*dy, 
+                    m_field.y + m_jac[1][0]*dx + m_jac[1][1]*dy, 0.0);
+}
+
+/*********************************************************************/
+/* Potential consistent with Field(), i.e. -grad(U) == Field().      */
+/*********************************************************************/
+double CFieldModel::Potential(const cVector3d& p) const
+{
+   double dx = p.x - m_pos.x, dy = p.y - m_pos.y;
+   double quad = m_jac[0][0]*dx*dx + 2*m_jac[0][1]*dx*dy + m_jac[1][1]*dy*dy;
+   
+   return m_potential - m_field.x*dx - m_field.y*dy - 0.5*quad;
+}
+
+/*********************************************************************/
+/* Fast haptic tick on top of a CFieldModel.  A passivity observer   */
+/*    compares the work the device has done on the user with what    */
+/*    the potential allows.  If extrapolation has made energy, a     */
+/*    passivity controller damps it back out.                        */
+/*********************************************************************/
+class CHapticRenderer {
+public:
+   
+   CHapticRenderer();
+   
+   void Reset();
+   cVector3d Tick(const cVector3d& p, double dt, const CFieldModel& model);
+   
+   bool m_passivity;         // Passivity controller on/off
+   bool m_started;
+   unsigned int m_serial;    // Model the reference is anchored to
+   cVector3d m_lastPos;
+   cVector3d m_lastForce;    // Unclamped force from the previous tick
+   double m_work;            // Work done on the user so far
+   double m_uStart;          // Potential the work is measured against
+   double m_excess;          // Energy generated by the renderer
+   double m_dissipated;      // Energy removed by the controller
+};
+
+CHapticRenderer::CHapticRenderer()
+{
+   m_passivity = true;
+   Reset();
+}
+
+void CHapticRenderer::Reset()
+{
+   m_started = false;
+   m_serial = 0;
+   m_work = m_uStart = m_excess = m_dissipated = 0.0;
+   m_lastForce = cVector3d(0.0, 0.0, 0.0);
+}
+
+/*********************************************************************/
+/* Device force for position p (GLUT coordinates, z out of plane).   */
+/*    The observer watches the force before DeviceForce() clamps it, */
+/*    so it only sees energy made by the extrapolation itself.       */
+/*********************************************************************/
+cVector3d CHapticRenderer::Tick(const cVector3d& p, double dt, 
+                                const CFieldModel& model)
+{
+   cVector3d pp(p.x, p.y, 0.0);
+   
+   // New model: its potential differs from the old model's by the
+   //    old model's truncation error (or the charges moved), so 
+   //    re-anchor the reference at the last position without 
+   //    forgetting the excess we already have
+   if (m_started == false || model.m_serial != m_serial)
+   {
+      if (m_started == false) m_lastPos = pp;
+      m_uStart = m_work + model.Potential(m_lastPos) - m_excess;
+      m_serial = model.m_serial;
+      m_started = true;
+   }
+   
+   // Work done on the user by the force held over the last tick
+   cVector3d dx = pp - m_lastPos;
+   m_work += m_lastForce.x*dx.x + m_lastForce.y*dx.y;
+   
+   // Passivity observer
+   m_excess = m_work - (m_uStart - model.Potential(pp));
+   if (m_excess < -MAX_ENERGY_CREDIT)
+   {
+      m_work += -MAX_ENERGY_CREDIT - m_excess;
+      m_excess = -MAX_ENERGY_CREDIT;
+   }
+   
+   cVector3d f = model.Field(pp);
+   
+   // Passivity controller
+   if (m_passivity && m_excess > 0.0 && dt > 0.0)
+   {
+      cVector3d v = dx / dt;
+      double vv = v.x*v.x + v.y*v.y;
+      if (vv > 1e-6)
+      {
+         double alpha = m_excess / (vv * dt);
+         if (alpha > MAX_DAMPING) alpha = MAX_DAMPING;
+         m_dissipated += alpha * vv * dt;
+         f.x -= alpha * v.x;
+         f.y -= alpha * v.y;
+      }
+   }
+   
+   m_lastPos = pp;
+   m_lastForce = f;
+   return DeviceForce(f, p.z);
+}
+
+/** Multi-rate haptics ***********************************************/
+pthread_mutex_t modelMutex = PTHREAD_MUTEX_INITIALIZER;
+CFieldModel fieldModel;          // Latest model from the field thread
+cVector3d modelProbe;            // Where the next model should be built
+CHapticRenderer hapticRenderer;
+pthread_t fieldThread;
+
+/*********************************************************************/
+/* Slow field thread: linearize the field around the device a few    */
+/*    hundred times a second.                                        */
+/*********************************************************************/
+void* FieldLoop(void* a_pUserData)
+{
+   for (;;)
+   {
+      usleep(1000000 / FIELD_RATE);
+      if (enableHaptics == false) continue;
+      
+      pthread_mutex_lock(&modelMutex);
+      cVector3d p = modelProbe;
+      pthread_mutex_unlock(&modelMutex);
+      
+      CFieldModel model;
+      pthread_mutex_lock(&sceneMutex);
+      model.Linearize(p.x, p.y);
+      pthread_mutex_unlock(&sceneMutex);
+      
+      pthread_mutex_lock(&modelMutex);
+      fieldModel = model;
+      pthread_mutex_unlock(&modelMutex);
+   }
+   return NULL;
+}
+
+/*********************************************************************/
+/* Run the multi-rate renderer against a scripted device trajectory  */
+/*    and compare it with evaluating the full field every tick.      */
+/*    Invoked with 'pointcharge -hapticsim'; no window or device.    */
+/*********************************************************************/
+int RunHapticSim()
+{
+   const double tickRate = HAPTIC_RATE, seconds = 10.0;
+   const int ticksPerModel = (int)(tickRate / FIELD_RATE);
+   const int ticks = (int)(tickRate * seconds);
+   const double dt = 1.0 / tickRate;
+   
+   // Something with a bit of everything in it
+   m_simcharges.push_back(NewCharge(SHAPE_POINT, 250, 300, 5));
+   m_simcharges.push_back(NewCharge(SHAPE_POINT, 560, 380, -4));
+   m_simcharges.push_back(NewCharge(SHAPE_SEGMENT, 400, 150, 3));
+   m_simcharges.push_back(NewCharge(SHAPE_RING, 420, 470, -2));
+   for (int i = 0; i < 200; i++)
+      m_simcharges.push_back(NewCharge(SHAPE_POINT, 100 + 3*i, 560, (i % 2) ? 1 : -1));
+   
+   // Closed Lissajous loop through the scene, 10 s period
+   std::vector<cVector3d> path(ticks + 1);
+   for (int n = 0; n <= ticks; n++)
+   {
+      double t = n * dt;
+      path[n] = cVector3d(400 + 300*sin(2*PI*0.5*t), 
+                          325 + 220*sin(2*PI*0.7*t + 0.3), 0.0);
+   }
+   
+   CHapticRenderer withPC, withoutPC;
+   withoutPC.m_passivity = false;
+   CFieldModel model, pending, held;
+   
+   double errLin = 0, errHold = 0, maxLin = 0, maxHold = 0;
+   double workExact = 0, workLin = 0, workPC = 0, gross = 0;
+   cVector3d fExact, fLin, fPC;    // Unclamped, for the work integrals
+   
+   for (int n = 0; n <= ticks; n++)
+   {
+      const cVector3d& p = path[n];
+      
+      // The field thread samples the position one period before its 
+      //    model is ready, just like the real one
+      if (n % ticksPerModel == 0)
+      {
+         model = pending;
+         if (model.m_valid == false) model.Linearize(p.x, p.y);
+         held = model;
+         pending.Linearize(p.x, p.y);
+      }
+      
+      if (n > 0)
+      {
+         cVector3d dx = p - path[n-1];
+         workExact += fExact.x*dx.x + fExact.y*dx.y;
+         gross += fabs(fExact.x*dx.x + fExact.y*dx.y);
+         workLin += fLin.x*dx.x + fLin.y*dx.y;
+         workPC += fPC.x*dx.x + fPC.y*dx.y;
+      }
+      
+      fExact = GetField(p.x, p.y);
+      cVector3d dExact = DeviceForce(fExact, 0.0);
+      cVector3d dLin = withoutPC.Tick(p, dt, model);
+      fLin = withoutPC.m_lastForce;
+      withPC.Tick(p, dt, model);
+      fPC = withPC.m_lastForce;
+      cVector3d dHold = DeviceForce(held.m_field, 0.0);
+      
+      double eLin = (dLin - dExact).length(), eHold = (dHold - dExact).length();
+      errLin += eLin*eLin; errHold += eHold*eHold;
+      if (eLin > maxLin) maxLin = eLin;
+      if (eHold > maxHold) maxHold = eHold;
+   }
+   
+   // Cost of one linearization vs. one fast tick
+   double t0 = SimNow();
+   for (int i = 0; i < 200; i++) model.Linearize(path[i].x, path[i].y);
+   double t1 = SimNow();
+   CHapticRenderer r;
+   for (int i = 0; i < 200000; i++) r.Tick(path[i % ticks], dt, model);
+   double t2 = SimNow();
+   
+   printf("Haptic sim: %d charges, %.0f Hz tick, %d Hz field model, %.0f s loop\n", 
+          (int)m_simcharges.size(), tickRate, FIELD_RATE, seconds);
+   printf("  force error, zero-order hold:  rms %.4f  max %.4f\n", 
+          sqrt(errHold / (ticks+1)), maxHold);
+   printf("  force error, linear model:     rms %.4f  max %.4f\n", 
+          sqrt(errLin / (ticks+1)), maxLin);
+   printf("  net work over the loop: exact %.4f  linear %.4f  linear+PC %.4f"
+          "  (gross %.1f)\n", workExact, workLin, workPC, gross);
+   printf("  passivity controller loss: %.4f\n", withPC.m_dissipated);
+   printf("  cost: linearize %.1f us, tick %.3f us\n", 
+          (t1 - t0) / 200 * 1e6, (t2 - t1) / 200000 * 1e6);
+   
+   // The loop must not gain more than the credit the observer may 
+   //    hand back, and the controller must not turn into a brake
+   bool passive = workPC <= MAX_ENERGY_CREDIT;
+   bool gentle = withPC.m_dissipated <= 0.01 * gross;
+   printf("  %s: loop %s, controller loss %s 1%% of gross work\n", 
+          (passive && gentle) ? "PASS" : "FAIL", 
+          passive ? "passive" : "ACTIVE", gentle ? "within" : "ABOVE");
+   
+   return (passive && gentle) ? 0 : 1;
 }
 
 /*********************************************************************/
@@ -653,7 +2677,11 @@ cVector3d GetDevicePos()
 void hapticsLoop(void* a_pUserData)
 {
    // Quit if haptics isn't enabled
-   if(enableHaptics == false) return;
+   if(enableHaptics == false) 
+   {
+      hapticRenderer.Reset();
+      return;
+   }
    
    // Read the position of the haptic device
    cursor->updatePose();
@@ -670,7 +2698,17 @@ void hapticsLoop(void* a_pUserData)
    
    cVector3d devpos = GetDevicePos();
    //printf("Cursor: x: %f, y: %f, z: %f\n", devpos.x, devpos.y, devpos.z);
-   cVector3d devforce = GetForce(devpos.x, devpos.y, devpos.z);
+   
+   // Hand the position to the field thread and grab its latest model
+   pthread_mutex_lock(&modelMutex);
+   modelProbe = devpos;
+   CFieldModel model = fieldModel;
+   pthread_mutex_unlock(&modelMutex);
+   
+   // Extrapolate the force from the model
+   cVector3d devforce = DeviceForce(cVector3d(0, 0, 0), devpos.z);
+   if (model.m_valid)
+      devforce = hapticRenderer.Tick(devpos, increment, model);
    /* Rotate axes */
    cVector3d rotdevforce = cVector3d(devforce.x, devforce.z, devforce.y);
    cursor->m_lastComputedGlobalForce = rotdevforce;
@@ -693,11 +2731,56 @@ void hapticsLoop(void* a_pUserData)
    cursor->applyForces();
 }
 
+/*********************************************************************/
+/* Haptic thread.  The timer callback tops out around 1 kHz, so tick */
+/*    against the wall clock instead: sleep most of each period and  */
+/*    spin for the rest.  If we fall well behind (e.g. the thread    */
+/*    was descheduled) we skip ahead rather than tick in a burst.    */
+/*********************************************************************/
+void* HapticLoop(void* a_pUserData)
+{
+   double period = 1.0 / HAPTIC_RATE;
+   double next = SimNow();
+   
+   for (;;)
+   {
+      hapticsLoop(NULL);
+      
+      next += period;
+      double wait = next - SimNow();
+      if (wait > 200e-6) usleep((useconds_t)((wait - 100e-6) * 1e6));
+      while (SimNow() < next) ;
+      
+      if (SimNow() - next > 10*period) next = SimNow();
+   }
+   return NULL;
+}
+
 /*********************************************************************/
 /* The magic starts here! ********************************************/
 /*********************************************************************/
 int main(int argc, char **argv)
 {
+   // Periodic mode settings
+   for (int i = 1; i < argc; i++)
+   {
+      if (strcmp(argv[i], "-periodic") == 0) periodicMode = true;
+      if (strcmp(argv[i], "-rcut") == 0 && i + 1 < argc) ewaldCutoff = atof(argv[i+1]);
+      if (strcmp(argv[i], "-mesh") == 0 && i + 1 < argc) ewaldMesh = atoi(argv[i+1]);
+   }
+   ewald.Limits(ewaldCutoff, ewaldMesh);
+   
+   // Headless checks of the multi-rate haptic renderer, the periodic
+   //    solver, the scene stream and the ring charge
+   if (argc > 1 && strcmp(argv[1], "-hapticsim") == 0)
+      return RunHapticSim();
+   if (argc > 1 && strcmp(argv[1], "-ewaldcheck") == 0)
+      return RunEwaldCheck();
+   if (argc > 1 && strcmp(argv[1], "-streamcheck") == 0)
+      return RunStreamCheck();
+   if (argc > 1 && strcmp(argv[1], "-ringcheck") == 0)
+      return RunRingCheck();
+   
    glutInit(&argc, argv);
    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA);
    
@@ -718,8 +2801,9 @@ int main(int argc, char **argv)
    cursor->initialize();
    cursor->start();
    
-   // Start haptic timer callback
-   timer.set(0, hapticsLoop, NULL);
+   // Start the haptic tick, fed by the slower field thread
+   pthread_create(&fieldThread, NULL, FieldLoop, NULL);
+   pthread_create(&hapticThread, NULL, HapticLoop, NULL);
    
    // Callbacks
    glutDisplayFunc(Display);
@@ -733,6 +2817,13 @@ int main(int argc, char **argv)
    MyInit();
    InitMenu();
    
+   // Optionally take scene updates from another process:
+   //    pointcharge -stream -            (stdin)
+   //    pointcharge -stream /tmp/pc.sock (Unix domain socket)
+   for (int i = 1; i + 1 < argc; i++)
+      if (strcmp(argv[i], "-stream") == 0 && !StartStream(argv[i+1]))
+         return 1;
+   
    // GO!!!
    glutMainLoop();
    return 0;        
@@ -0,0 +1,150 @@
+/*********************************************************************/
+/* Point Charge Simulator - scene stream test client                 */
+/*                                                                   */
+/* Drives a running simulator through its scene stream.  Adds a      */
+/* ring of charges, then swings them around at the requested update  */
+/* rate and reports the rate it wrote.  The simulator prints the     */
+/* rate it applied once a second.                                    */
+/*                                                                   */
+/* Usage:                                                            */
+/*    pcfeed /tmp/pc.sock [charges] [updates/s] [seconds]            */
+/*    pcfeed - [charges] [updates/s] [seconds] | pointcharge \       */
+/*       -stream -                                                   */
+/*                                                                   */
+/* Build:                                                            */
+/*    c++ -O2 -o pcfeed pcfeed.cpp                                   */
+/*********************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "scenestream.h"
+
+#define PI 3.14159265
+
+// Same layout as the simulator window
+#define MENU_H 50
+#define VIEWPORT_W 800
+#define VIEWPORT_H 600
+
+double Now()
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/*********************************************************************/
+/* Write a whole batch, riding out short writes.                     */
+/*********************************************************************/
+bool SendBatch(int fd, std::vector<StreamRecord>& records)
+{
+   StreamBatchHeader h;
+   h.magic = STREAM_MAGIC;
+   h.count = records.size();
+
+   std::vector<char> buf(sizeof(h) + records.size() * sizeof(StreamRecord));
+   memcpy(&buf[0], &h, sizeof(h));
+   if (!records.empty())
+      memcpy(&buf[sizeof(h)], &records[0], records.size() * sizeof(StreamRecord));
+
+   size_t sent = 0;
+   while (sent < buf.size())
+   {
+      ssize_t n = write(fd, &buf[sent], buf.size() - sent);
+      if (n <= 0) return false;
+      sent += n;
+   }
+   return true;
+}
+
+StreamRecord MakeRecord(int op, uint32_t id, float x, float y)
+{
+   StreamRecord r;
+   memset(&r, 0, sizeof(r));
+   r.op = op;
+   r.id = id;
+   r.x = x; r.y = y;
+   return r;
+}
+
+int main(int argc, char **argv)
+{
+   if (argc < 2)
+   {
+      fprintf(stderr, "usage: %s <socket|-> [charges] [updates/s] [seconds]\n", argv[0]);
+      return 1;
+   }
+
+   int charges = argc > 2 ? atoi(argv[2]) : 100;
+   double rate = argc > 3 ? atof(argv[3]) : 100000;
+   double seconds = argc > 4 ? atof(argv[4]) : 5;
+
+   if (charges <= 0 || rate <= 0 || seconds <= 0)
+   {
+      fprintf(stderr, "%s: charges, updates/s and seconds must be positive\n", argv[0]);
+      return 1;
+   }
+
+   int fd = 1;
+   if (strcmp(argv[1], "-") != 0)
+   {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+      {
+         perror(argv[1]);
+         return 1;
+      }
+   }
+
+   float cx = VIEWPORT_W / 2, cy = (VIEWPORT_H + MENU_H) / 2;
+   std::vector<StreamRecord> batch;
+
+   // Start from a clean slate, then add alternating charges
+   batch.push_back(MakeRecord(STREAM_CLEAR, 0, 0, 0));
+   for (int i = 0; i < charges; i++)
+   {
+      StreamRecord r = MakeRecord(STREAM_ADD, i, cx, cy);
+      r.charge = (i % 2) ? -1 : 1;
+      batch.push_back(r);
+   }
+   if (!SendBatch(fd, batch)) return 1;
+
+   // Send a batch every millisecond
+   double start = Now();
+   long sent = 0;
+   while (Now() - start < seconds)
+   {
+      double t = Now() - start;
+      long due = (long)(t * rate);
+
+      batch.clear();
+      for (; sent < due; sent++)
+      {
+         int i = sent % charges;
+         float th = 2*PI*i/charges + t;
+         float rad = 100 + 80*sin(3*t + i);
+         batch.push_back(MakeRecord(STREAM_MOVE, i, cx + rad*cos(th), cy + rad*sin(th)));
+      }
+      if (!batch.empty() && !SendBatch(fd, batch))
+      {
+         fprintf(stderr, "Stream closed after %ld updates\n", sent);
+         return 1;
+      }
+      usleep(1000);
+   }
+
+   fprintf(stderr, "Wrote %ld updates in %.2f s (%.0f updates/s)\n",
+           sent, Now() - start, sent / (Now() - start));
+   return 0;
+}
@@ -0,0 +1,60 @@
+/*********************************************************************/
+/* Point Charge Simulator - scene streaming wire format              */
+/*                                                                   */
+/* An external process can drive the scene over stdin or a Unix      */
+/* domain socket.  The stream is a sequence of batches, each one a   */
+/* StreamBatchHeader followed by 'count' StreamRecords.  Everything  */
+/* is in host byte order, since both ends live on the same machine.  */
+/*                                                                   */
+/* Charges are named by a caller-chosen id.  Coordinates are window  */
+/* coordinates with the origin in the bottom left corner.            */
+/*                                                                   */
+/* Segments, polylines and rings are added with a default outline    */
+/* around (x, y).  STREAM_VERTEX records then place their handles,   */
+/* as offsets from (x, y) so that a later STREAM_MOVE carries the    */
+/* whole shape along: the vertices of a segment or polyline, or any  */
+/* point on the wire of a ring, which sets its radius.               */
+/*********************************************************************/
+#ifndef SCENESTREAM_H
+#define SCENESTREAM_H
+
+#include <stdint.h>
+
+#define STREAM_MAGIC 0x42534350   // "PCSB"
+#define STREAM_MAX_BATCH 65536    // Larger batches drop the connection
+#define STREAM_MAX_COORD 10000.0  // Records with |x| or |y| beyond this,
+                                  //    or not finite, are dropped
+#define STREAM_MAX_CHARGE 9       // Charges are clamped to +/- this
+
+// Record opcodes
+#define STREAM_ADD 1              // Add (or replace) charge 'id'
+#define STREAM_MOVE 2             // Move charge 'id' to (x, y)
+#define STREAM_REMOVE 3           // Remove charge 'id'
+#define STREAM_CLEAR 4            // Remove every streamed charge
+#define STREAM_VERTEX 5           // Put handle 'index' of 'id' at (x, y)
+                                  //    from the charge's own (x, y)
+
+// Charge shapes, as dragged out of the menu
+#define SHAPE_POINT 0
+#define SHAPE_SEGMENT 1
+#define SHAPE_POLYLINE 2
+#define SHAPE_RING 3
+#define NUM_SHAPES 4
+
+struct StreamBatchHeader {
+   uint32_t magic;
+   uint32_t count;                // Number of records that follow
+};
+
+struct StreamRecord {
+   uint8_t op;                    // STREAM_*
+   uint8_t shape;                 // SHAPE_* (STREAM_ADD only)
+   int8_t charge;                 // Charge value (STREAM_ADD only)
+   uint8_t index;                 // STREAM_ADD: vertex count of a polyline
+                                  //    (2 or more), else the default one
+                                  // STREAM_VERTEX: handle number
+   uint32_t id;
+   float x, y;
+};
+
+#endif